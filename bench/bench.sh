@@ -0,0 +1,109 @@
+#!/bin/sh
+# bench.sh: time mpkg against a synthetic repository.
+#
+#   BENCH_PKGS   packages to generate (default 1000)
+#   BENCH_FILES  files per package (default 10)
+#   BENCH_SIZE   bytes per file (default 512)
+#   BENCH_DEPS   dependencies per package (default 2)
+#   BENCH_FORMAT package compression, xz or zst (default xz)
+#   BENCH_DIR    scratch directory (default /tmp/mpkg-bench)
+#   BENCH_STORE  1 to install through the file store (PKG_FILE_STORE)
+#   BENCH_HTTP   serve the repository over http on this port instead of file://
+#   BENCH_MIRRORS mirror.py options for each of several mirrors on ports
+#                BENCH_HTTP, BENCH_HTTP+1, ..., separated by ';', e.g.
+#                "--fail;--delay 0.2 --rate 1000000;" (needs BENCH_HTTP)
+#   BENCH_OUT    results file (default bench/results.json)
+#
+# The image phase builds a separate tree with --root from the warm cache.
+# refuse removes a package everything else needs and must fail; cascade
+# then removes it from the image along with its dependents.
+#
+# Prints one JSON object with the parameters and the wall time of each
+# phase in seconds, and writes the same object to BENCH_OUT so runs can be
+# diffed. Everything happens under BENCH_DIR; the real database and
+# config are never touched.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+MPKG=${MPKG:-$here/../mpkg}
+PKGS=${BENCH_PKGS:-1000}
+FILES=${BENCH_FILES:-10}
+SIZE=${BENCH_SIZE:-512}
+DEPS=${BENCH_DEPS:-2}
+FORMAT=${BENCH_FORMAT:-xz}
+DIR=${BENCH_DIR:-/tmp/mpkg-bench}
+OUT=${BENCH_OUT:-$here/results.json}
+
+rm -rf "$DIR"
+mkdir -p "$DIR/repo" "$DIR/db" "$DIR/cache" "$DIR/root" "$DIR/image"
+url="file://$DIR/repo" transport=file
+"$here/genrepo" "$DIR/repo" "$PKGS" "$FILES" "$SIZE" "$DIR/root" "$DEPS" "$FORMAT"
+if [ -n "$BENCH_HTTP" ] && [ -n "$BENCH_MIRRORS" ]; then
+    servers="" url="" port=$BENCH_HTTP
+    rest="$BENCH_MIRRORS;"
+    while [ -n "$rest" ]; do
+        opts=${rest%%;*} rest=${rest#*;}
+        python3 "$here/mirror.py" "$DIR/repo" "$port" $opts >/dev/null 2>&1 &
+        servers="$servers $!" url="$url${url:+ }http://127.0.0.1:$port"
+        port=$((port + 1))
+    done
+    trap 'kill $servers' EXIT
+    sleep 1
+    transport=mirrors
+elif [ -n "$BENCH_HTTP" ]; then
+    python3 -m http.server "$BENCH_HTTP" -d "$DIR/repo" >/dev/null 2>&1 &
+    server=$!
+    trap 'kill $server' EXIT
+    sleep 1
+    url="http://127.0.0.1:$BENCH_HTTP" transport=http
+fi
+cat > "$DIR/mpkg.conf" <<CONF
+PKG_DB_PATH=$DIR/db
+PKG_CACHE_PATH=$DIR/cache
+PKG_REPO_URL=$url
+PKG_FILE_STORE=${BENCH_STORE:-0}
+CONF
+export MPKG_CONFIG="$DIR/mpkg.conf"
+
+now() { date +%s%N; }
+results=""
+# phase <name> <expected status> <mpkg args...>
+phase() {
+    name=$1 want=$2; shift 2
+    t0=$(now)
+    set +e
+    "$MPKG" "$@" > "$DIR/$name.log" 2>&1
+    rc=$?
+    set -e
+    t1=$(now)
+    case "$want:$rc" in ok:0|fail:[1-9]*) ;; *)
+        echo "bench: $name exited $rc, see $DIR/$name.log" >&2
+        exit 1;;
+    esac
+    secs=$(awk "BEGIN { printf \"%.3f\", ($t1 - $t0) / 1e9 }")
+    echo "$name: ${secs}s" >&2
+    results="$results${results:+, }\"$name\": $secs"
+}
+
+all=$(awk -v n="$PKGS" 'BEGIN { for (i = 0; i < n; i++) printf "bench%05d ", i }')
+phase update ok update
+phase install ok install $all
+phase list ok list
+phase search ok search bench
+phase info ok info bench00000
+phase stats ok stats
+phase doctor ok doctor
+phase conflict fail install benchconflict
+phase upgrade ok upgrade
+phase refuse fail remove bench00000
+phase remove ok remove $all
+phase reinstall ok install $all
+phase autoremove ok autoremove
+# the same database through libmpkg, in-process (bench/query, built by make bench)
+if [ -x "$here/query" ]; then "$here/query" > "$DIR/query.log"; cat "$DIR/query.log" >&2; fi
+phase image ok --root "$DIR/image" install $all
+phase cascade ok --root "$DIR/image" remove --cascade bench00000
+
+version=$(git -C "$here" describe --always --dirty 2>/dev/null || echo unknown)
+json="{\"version\": \"$version\", \"packages\": $PKGS, \"files\": $FILES, \"size\": $SIZE, \"deps\": $DEPS, \"format\": \"$FORMAT\", \"store\": ${BENCH_STORE:-0}, \"transport\": \"$transport\", \"seconds\": {$results}}"
+echo "$json" > "$OUT"
+echo "$json"
@@ -0,0 +1,128 @@
+/* genrepo: write a synthetic mpkg repository for benchmarking.
+
+   genrepo <dir> <packages> <files> <size> <root> [deps] [xz|zst]
+
+   Creates <dir>/bench#####.tar.xz (or .tar.zst) with <files> files of about <size>
+   bytes each under <root>/usr/share/<name>/, a repo.db listing them
+   with csize and sha256, and benchconflict, which claims a file of
+   bench00000. Each package depends on up to [deps] (default 2) lower
+   numbered packages, so installing the last few pulls in a deep DAG. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <openssl/evp.h>
+
+static int zst;
+
+static unsigned long long rng = 88172645463325252ULL;
+
+static unsigned long long next_rand(void) {
+    rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17;
+    return rng;
+}
+
+/* half random, half repeated text: roughly what real files compress to */
+static void fill(char *buf, size_t n) {
+    static const char text[] = "the quick brown fox jumps over the lazy dog\n";
+    for (size_t i = 0; i < n; i++)
+        buf[i] = (i / 64) % 2 ? text[i % (sizeof(text) - 1)] : (char)next_rand();
+}
+
+static void add_file(struct archive *a, const char *path, const char *data, size_t n) {
+    struct archive_entry *e = archive_entry_new();
+    archive_entry_set_pathname(e, path);
+    archive_entry_set_size(e, n);
+    archive_entry_set_filetype(e, AE_IFREG);
+    archive_entry_set_perm(e, 0644);
+    archive_entry_set_mtime(e, 1700000000, 0);
+    archive_write_header(a, e);
+    archive_write_data(a, data, n);
+    archive_entry_free(e);
+}
+
+static int sha256_file(const char *path, char *hex, long long *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return -1;
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(md, EVP_sha256(), NULL);
+    char buf[65536];
+    size_t n;
+    *size = 0;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0) { EVP_DigestUpdate(md, buf, n); *size += n; }
+    fclose(f);
+    unsigned char d[EVP_MAX_MD_SIZE];
+    unsigned int len;
+    EVP_DigestFinal_ex(md, d, &len);
+    EVP_MD_CTX_free(md);
+    for (unsigned int i = 0; i < len; i++) sprintf(hex + 2*i, "%02x", d[i]);
+    return 0;
+}
+
+/* one package: PKGINFO plus its files; appends its stanza to db */
+static int write_package(const char *dir, const char *name, const char *depends,
+                         int files, size_t size, const char *root, const char *victim, FILE *db) {
+    char path[1024], member[1024], info[2048];
+    snprintf(path, sizeof(path), "%s/%s.tar.%s", dir, name, zst ? "zst" : "xz");
+    struct archive *a = archive_write_new();
+    if (zst) archive_write_add_filter_zstd(a);
+    else {
+        archive_write_add_filter_xz(a);
+        archive_write_set_options(a, "xz:compression-level=1");
+    }
+    archive_write_set_format_pax_restricted(a);
+    if (archive_write_open_filename(a, path) != ARCHIVE_OK) {
+        fprintf(stderr, "%s: %s\n", path, archive_error_string(a));
+        archive_write_free(a);
+        return -1;
+    }
+    int n = snprintf(info, sizeof(info), "name=%s\nversion=1.0\narch=x86_64\ndescription=Synthetic package %s\ndepends=%s\nsize=%zu\n",
+                     name, name, depends, (size_t)files * size);
+    add_file(a, "PKGINFO", info, n);
+    char *buf = malloc(size + 1);
+    for (int i = 0; i < files; i++) {
+        fill(buf, size);
+        snprintf(member, sizeof(member), "%s/usr/share/%s/f%d", root, victim ? victim : name, i);
+        add_file(a, member + (member[0] == '/'), buf, size);
+    }
+    free(buf);
+    archive_write_close(a);
+    archive_write_free(a);
+    char hex[2 * EVP_MAX_MD_SIZE + 1];
+    long long csize;
+    if (sha256_file(path, hex, &csize)) return -1;
+    fprintf(db, "name=%s\nversion=1.0\narch=x86_64\ndescription=Synthetic package %s\ndepends=%s\nsize=%zu\ncsize=%lld\nsha256=%s\n%s\n",
+            name, name, depends, (size_t)files * size, csize, hex, zst ? "format=tar.zst\n" : "");
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 6) {
+        fprintf(stderr, "usage: genrepo <dir> <packages> <files> <size> <root> [deps] [xz|zst]\n");
+        return 1;
+    }
+    const char *dir = argv[1], *root = argv[5];
+    int npkgs = atoi(argv[2]), files = atoi(argv[3]), ndeps = argc > 6 ? atoi(argv[6]) : 2;
+    size_t size = strtoul(argv[4], NULL, 10);
+    zst = argc > 7 && !strcmp(argv[7], "zst");
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/repo.db", dir);
+    FILE *db = fopen(path, "w");
+    if (!db) { perror(path); return 1; }
+    for (int i = 0; i < npkgs; i++) {
+        char name[32], depends[256] = "";
+        snprintf(name, sizeof(name), "bench%05d", i);
+        for (int k = 0; k < ndeps && i > 0; k++) {
+            char dep[32];
+            snprintf(dep, sizeof(dep), "%sbench%05d", *depends ? ", " : "", (int)(next_rand() % i));
+            if (!strstr(depends, dep + (*depends ? 2 : 0))) strcat(depends, dep);
+        }
+        if (write_package(dir, name, depends, files, size, root, NULL, db)) return 1;
+    }
+    if (npkgs && write_package(dir, "benchconflict", "", 1, size, root, "bench00000", db)) return 1;
+    if (fclose(db)) { perror(path); return 1; }
+    return 0;
+}
@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+"""mirror.py: serve a repository directory over HTTP as a mirror stand-in.
+
+  mirror.py <dir> <port> [options]
+
+  --delay S     wait S seconds before answering (latency)
+  --rate B      send at most B bytes per second (throughput)
+  --fail        answer everything with 503
+  --drop N      close the connection after N bytes of each body
+  --no-ranges   ignore Range and always send the whole file
+  --corrupt     flip one byte in the middle of every archive
+
+Byte ranges are served as mpkg asks for them (bytes=a-b and bytes=a-),
+so segmented downloads and resumes can be tried against a mix of fast,
+slow and broken mirrors on one machine.
+"""
+import argparse
+import os
+import re
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+opt = None
+
+
+class Mirror(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def log_message(self, *args):
+        pass
+
+    def do_GET(self):
+        if opt.delay:
+            time.sleep(opt.delay)
+        if opt.fail:
+            return self.send_error(503)
+        path = os.path.join(opt.dir, os.path.normpath(self.path.split("?")[0]).lstrip("/"))
+        if not os.path.isfile(path):
+            return self.send_error(404)
+        size = os.path.getsize(path)
+        start, end = 0, size - 1
+        m = re.match(r"bytes=(\d+)-(\d*)$", self.headers.get("Range", ""))
+        ranged = m and not opt.no_ranges
+        if ranged:
+            start = int(m.group(1))
+            end = min(int(m.group(2)), size - 1) if m.group(2) else size - 1
+            if start > end:
+                self.send_response(416)
+                self.send_header("Content-Range", "bytes */%d" % size)
+                self.send_header("Content-Length", "0")
+                return self.end_headers()
+        self.send_response(206 if ranged else 200)
+        if ranged:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, size))
+        self.send_header("Content-Length", str(end - start + 1))
+        self.send_header("Accept-Ranges", "none" if opt.no_ranges else "bytes")
+        self.end_headers()
+        with open(path, "rb") as f:
+            f.seek(start)
+            pos, sent, t0 = start, 0, time.monotonic()
+            while pos <= end:
+                block = f.read(min(65536, end - pos + 1))
+                if opt.corrupt and ".tar." in path and pos <= size // 2 < pos + len(block):
+                    i = size // 2 - pos
+                    block = block[:i] + bytes([block[i] ^ 0xff]) + block[i + 1:]
+                if opt.drop is not None and sent + len(block) > opt.drop:
+                    self.wfile.write(block[:opt.drop - sent])
+                    self.close_connection = True
+                    return
+                self.wfile.write(block)
+                pos += len(block)
+                sent += len(block)
+                if opt.rate:
+                    ahead = sent / opt.rate - (time.monotonic() - t0)
+                    if ahead > 0:
+                        time.sleep(ahead)
+
+
+def main():
+    global opt
+    p = argparse.ArgumentParser()
+    p.add_argument("dir")
+    p.add_argument("port", type=int)
+    p.add_argument("--delay", type=float, default=0)
+    p.add_argument("--rate", type=float, default=0)
+    p.add_argument("--fail", action="store_true")
+    p.add_argument("--drop", type=int)
+    p.add_argument("--no-ranges", action="store_true")
+    p.add_argument("--corrupt", action="store_true")
+    opt = p.parse_args()
+    ThreadingHTTPServer(("127.0.0.1", opt.port), Mirror).serve_forever()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,77 @@
+/* query: time the libmpkg queries in-process against the installed set.
+
+   query [rounds]
+
+   Uses the same config as mpkg (MPKG_CONFIG or /etc/mpkg.conf). Lists
+   everything, asks for info on every package in one batch, looks up
+   the owner of one file of each and runs a search, each [rounds]
+   (default 10) times, and prints the time per package and the heap the
+   list took. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <malloc.h>
+#include <time.h>
+#include "mpkg.h"
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *what, double secs, size_t n) {
+    printf("%-8s %8zu packages %10.3f us/package\n", what, n, n ? secs * 1e6 / n : 0);
+}
+
+int main(int argc, char *argv[]) {
+    int rounds = argc > 1 ? atoi(argv[1]) : 10;
+    mpkg *m = mpkg_open(NULL, NULL);
+    if (!m) { fprintf(stderr, "mpkg_open: %s\n", strerror(errno)); return 1; }
+
+    size_t heap = mallinfo2().uordblks;
+    mpkg_set *all = mpkg_list(m);
+    size_t n = mpkg_set_count(all);
+    heap = mallinfo2().uordblks - heap;
+    double t = now();
+    for (int r = 0; r < rounds; r++) mpkg_set_free(mpkg_list(m));
+    report("list", (now() - t) / rounds, n);
+    printf("%-8s %8zu bytes    %10.1f bytes/package\n", "heap", heap, n ? (double)heap / n : 0);
+
+    const char **names = malloc((n + 1) * sizeof(char *)), **paths = malloc((n + 1) * sizeof(char *));
+    char **files = calloc(n + 1, sizeof(char *));
+    size_t np = 0;
+    for (size_t i = 0; i < n; i++) {
+        names[i] = mpkg_set_get(all, i)->name;
+        char **f = mpkg_files(m, names[i]);
+        if (f && f[0]) paths[np++] = f[0];
+        files[i] = (char *)f;
+    }
+    t = now();
+    for (int r = 0; r < rounds; r++) mpkg_set_free(mpkg_info(m, names, n));
+    report("info", (now() - t) / rounds, n);
+
+    t = now();
+    for (int r = 0; r < rounds; r++) {
+        mpkg_set *s = mpkg_owners(m, paths, np);
+        if (!s) { fprintf(stderr, "mpkg_owners: %s\n", mpkg_error(m)); return 1; }
+        mpkg_set_free(s);
+    }
+    report("owners", (now() - t) / rounds, np);
+
+    t = now();
+    size_t hits = 0;
+    for (int r = 0; r < rounds; r++) {
+        mpkg_set *s = mpkg_search(m, n ? names[n / 2] : "x");
+        hits = mpkg_set_count(s);
+        mpkg_set_free(s);
+    }
+    printf("%-8s %8zu hits     %10.3f us\n", "search", hits, (now() - t) / rounds * 1e6);
+
+    for (size_t i = 0; i < n; i++) free(files[i]);
+    free(files); free(names); free(paths);
+    mpkg_set_free(all);
+    mpkg_close(m);
+    return 0;
+}
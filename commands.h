@@ -0,0 +1,41 @@
+/* commands.h: what the mpkg command line runs in libmpkg. These print
+   as they go and are not part of the stable API in mpkg.h; the shared
+   library doesn't export them, so the CLI links libmpkg.a. */
+#ifndef MPKG_COMMANDS_H
+#define MPKG_COMMANDS_H
+
+#include <stdio.h>
+
+extern char PKG_ROOT[256];
+extern char PKG_ROOT_DB[256];
+extern int PKG_VERBOSE;
+
+#define REMOVE_CHECK 0      /* refuse while something installed needs them */
+#define REMOVE_CASCADE 1    /* take what needs them along */
+#define REMOVE_FORCE 2      /* the caller knows the result is consistent */
+
+int read_config(void);
+int db_init(void);
+int timing_start(int summary, const char *trace);
+int sync_repository(void);
+int update_package(const char *package_name);
+int install_multiple_packages(int count, char *packages[]);
+int upgrade_packages(void);
+int remove_packages(int count, char *names[], int how);
+int autoremove(void);
+int ghost_install(const char *package_name);
+int self_update(void);
+void show_stats(void);
+int clean_aggressive(void);
+int store_prune(void);
+void run_doctor(void);
+void list_generations(void);
+int rollback(const char *gen);
+
+/* mpkgd: answer queries on the socket with query(argc, argv, out, err),
+   which prints its reply to out and err rather than stdout and stderr */
+int run_daemon(int (*query)(int argc, char *argv[], FILE *out, FILE *err));
+/* ask a running mpkgd; 0 with *status set if it answered */
+int daemon_query(int argc, char *argv[], int *status);
+
+#endif
@@ -0,0 +1,5119 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <archive.h>
+#include <archive_entry.h>
+#include <errno.h>
+#include <time.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/openat2.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <signal.h>
+#include <curl/curl.h>
+#include <lzma.h>
+#include <openssl/evp.h>
+#include <zstd.h>
+#include "mpkg.h"
+#include "commands.h"
+
+#define CONFIG_FILE "/etc/mpkg.conf"
+#define LOG_FILE "/var/log/mpkg.log"
+#define HISTORY_DIR "history"   /* generations, under PKG_DB_PATH */
+#define STORE_DIR "objects"     /* file store, under PKG_CACHE_PATH */
+
+char PKG_DB_PATH[256] = "/var/db/mpkg";
+char PKG_CACHE_PATH[256] = "/var/cache/mpkg";
+char PKG_REPO_URL[2048] = "https://loxsete.github.io/mpkg-server/";     /* mirrors, space separated */
+int PKG_PARALLEL_DOWNLOADS = 4;
+int PKG_STREAM_INSTALL = 0;     /* unpack straight from the network */
+int PKG_KEEP_CACHE = 1;         /* keep a copy of streamed archives */
+int PKG_DECODE_THREADS = 0;     /* xz decoder threads, 0 = one per CPU */
+int PKG_VERBOSE = 0;            /* list every file as it is unpacked */
+int PKG_FILE_STORE = 0;         /* deploy files from the content-addressed store */
+char PKG_ROOT[256] = "";        /* --root: install into this tree instead of / */
+char PKG_ROOT_DB[256] = "";     /* --dbpath: its database, default <root><PKG_DB_PATH> */
+static int root_fd = -1;        /* PKG_ROOT, for resolving paths inside it */
+
+typedef struct {
+    char name[256];
+    char version[64];
+    char arch[16];
+    char depends[1024];
+    char description[512];
+    size_t size;
+    time_t install_time;
+    uint32_t flags;     /* DB_AUTO */
+} Package;
+
+/* packages.db: header, records sorted by name, then the string pool.
+   Record fields are offsets into the pool; offset 0 is the empty string.
+   Version 2 follows the pool (8-aligned) with the dependency graph as
+   two CSR tables of record numbers, depends and their reverse:
+     DbGraph, dep_off[count+1], dep[nedges], rdep_off[count+1], rdep[nedges]
+   Only records that changed have their depends= parsed on a commit; the
+   rest carry their edges over, renumbered. */
+#define PKGDB_FILE "packages.db"
+#define PKGDB_MAGIC "MPKGDB01"
+#define PKGDB_VERSION 2
+
+#define DB_AUTO 1       /* installed only because something depended on it */
+#define DB_DANGLING 2   /* depends on something not installed: reparse next commit */
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t strings;
+    uint64_t strings_len;
+} DbHeader;
+
+typedef struct {
+    uint32_t name, version, arch, description, depends;
+    uint32_t flags;
+    uint64_t size;
+    int64_t install_time;
+} DbRecord;
+
+typedef struct {
+    uint32_t nedges, pad;
+} DbGraph;
+
+typedef struct {
+    Package pkg;
+    int del;
+} DbChange;
+
+static struct {
+    void *map;
+    size_t len;
+    const DbHeader *hdr;
+    const DbRecord *rec;
+    const char *str;
+    const uint32_t *dep_off, *dep, *rdep_off, *rdep;   /* NULL before version 2 */
+    DbChange *pending;  /* staged puts/deletes, merged on commit */
+    int npending, cap;
+    pthread_mutex_t lock;
+} db = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+#define DB_STR(off) (db.str + (off))
+
+/* paths.idx: open-addressed table of absolute path -> owning package.
+   paths.log holds changes since the table was last rebuilt. */
+#define PATHIDX_FILE "paths.idx"
+#define PATHLOG_FILE "paths.log"
+#define PATHIDX_MAGIC "MPKGPIX1"
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t nslots;
+    uint64_t count;
+    uint64_t strings;
+    uint64_t strings_len;
+} PathIdxHeader;
+
+typedef struct {
+    uint64_t hash;
+    uint32_t path, owner;
+} PathSlot;
+
+typedef struct {
+    uint64_t hash;
+    char *path;
+    char *owner;        /* NULL: removed since the last rebuild */
+} PathChange;
+
+static struct {
+    void *map;
+    size_t len;
+    const PathIdxHeader *hdr;
+    const PathSlot *slot;
+    const char *str;
+    PathChange *ov;     /* overlay replayed from paths.log */
+    uint32_t ovslots, ovused;
+    FILE *log;
+    int loaded;
+    pthread_mutex_t lock;
+} pidx = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+typedef struct {
+    char **v;
+    int n, cap;
+} PathList;
+
+/* journal: write-ahead log of the transaction in progress. Lines are
+   appended with write(2), so a crash loses at most the one being
+   written; only the commit record is synced.
+     B <op> <time>      begin
+     N <pkg>\t<path>    pkg is about to create path
+     T <pkg>\t<path>    pkg claimed path in the path index
+     I <pkg>\t...       pkg unpacked, its packages.db record
+     D <pkg>\t<path>    pkg's new version dropped path, which is deleted
+     X <pkg>            pkg is about to be removed
+     C                  commit
+   db_init() finishes or rolls back whatever a crash left behind. A
+   transaction holds an exclusive flock on JOURNAL_LOCK from begin to
+   commit: a second writer waits for it, and recovery only touches a
+   journal nobody holds, so a query never undoes an install in progress. */
+#define JOURNAL_FILE "journal"
+#define JOURNAL_LOCK "journal.lock"
+#define TXN_MAX_DEVS 16
+
+typedef struct {
+    dev_t dev[TXN_MAX_DEVS];
+    int fd[TXN_MAX_DEVS];
+    int n;
+} DevSet;
+
+static struct {
+    int fd;
+    int lockfd;         /* JOURNAL_LOCK, held for the whole transaction */
+    int recovering;     /* journal_recover is running under the lock */
+    int depth;          /* nested begins, committed at the outermost */
+    DevSet devs;        /* filesystems to sync at commit */
+    char op[32];        /* recorded with the generation */
+    pthread_mutex_t lock;
+} txn = { -1, -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* repo.idx: repo.db compiled at sync time. Entries are sorted by name and
+   reachable through a hash table; depends are pre-split into RepoDep runs
+   that point at the entry they name. */
+#define REPOIDX_VERSION 4
+#define REPOIDX_FILE "repo.idx"
+#define REPOIDX_MAGIC "MPKGRIX1"
+#define REPO_NONE 0xffffffffu
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t nslots;
+    uint32_t ndeps;
+    uint64_t src_size;  /* repo.db this was built from */
+    int64_t src_mtime;
+    uint64_t entries, slots, deps, strings, strings_len;
+    uint32_t ndeltas, pad;
+    uint64_t deltas;
+} RepoHeader;
+
+typedef struct {
+    uint32_t name, version, arch, description, depends;
+    uint32_t deps, ndeps;
+    uint32_t sha256;    /* archive checksum as hex, 0 if repo.db has none */
+    uint32_t deltas, ndeltas;
+    uint32_t format;    /* archive suffix, 0 for tar.xz */
+    uint32_t pad;
+    uint64_t size;
+    uint64_t csize;     /* archive size, 0 if unknown */
+} RepoEntry;
+
+typedef struct {
+    uint32_t name;
+    uint32_t entry;     /* index into the entries, REPO_NONE if absent */
+} RepoDep;
+
+/* zstd --patch-from delta that turns the archive with sha256 `from`
+   into this entry's archive */
+typedef struct {
+    uint32_t from, file;
+    uint64_t size;
+} RepoDelta;
+
+static struct {
+    void *map;
+    size_t len;
+    const RepoHeader *hdr;
+    const RepoEntry *ent;
+    const uint32_t *slot;
+    const RepoDep *dep;
+    const RepoDelta *delta;
+    const char *str;
+} repo;
+
+#define RS(off) (repo.str + (off))
+
+/* Bounded buffer between a transfer and the libarchive reader that
+   unpacks it. The transfer pauses when the buffer is full. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    char *buf;
+    size_t cap, head, len;
+    char *out;          /* handed to libarchive by stream_read */
+    size_t chunk;
+    int paused, done, failed, cancel;
+    int nopause;
+    CURLM *multi;
+} Stream;
+
+#define MIRROR_MAX 16
+#define SEGMENT_SIZE (4 << 20)  /* archives of two or more go in ranges */
+#define SEGMENT_MAX 64
+#define SEGMENT_CONNS 4         /* ranges of one archive in flight at once */
+
+struct Download;
+
+/* One transfer of a download: the whole file, or a byte range of it
+   when a large archive is spread across mirrors. */
+typedef struct {
+    struct Download *d;
+    uint64_t off, len;  /* len 0 for the whole file */
+    uint64_t got;       /* bytes of it written so far */
+    uint64_t base;      /* got when the current attempt started */
+    int mirror;         /* serving it, or the last to */
+    uint32_t tried;     /* mirrors it failed on */
+    int state;          /* 0 queued, 1 running, 2 done */
+    CURL *curl;
+} Segment;
+
+typedef struct Download {
+    char label[256];
+    char path[512];     /* relative to the mirror */
+    char out[512];
+    FILE *fp;
+    int state;          /* 0 queued, 1 running, 2 done, -1 failed */
+    Stream *stream;     /* if set, data goes here (and to out if fp) */
+    char sha256[65];    /* expected checksum, empty if none */
+    uint64_t csize, got;
+    EVP_MD_CTX *md;     /* hashes the data as it arrives */
+    int cached;         /* blob already in the cache, nothing to fetch */
+    char base[512];     /* if set, out is a delta against this blob */
+    double t0;          /* when the transfer started, for --timings */
+    Segment *seg;
+    int nseg, running;
+    int failed;         /* 1 out of mirrors, 2 also already reported */
+    CURLcode res;       /* why, for the message */
+    unsigned char busy[MIRROR_MAX];     /* running segments per mirror */
+} Download;
+
+/* transfers run on one curl multi handle in a background thread, so
+   connections are reused and the caller can work on finished items */
+typedef struct {
+    Download *items;
+    int n;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    pthread_t thread;
+} DownloadBatch;
+
+int is_installed(const char *package_name);
+int pkgdb_open(void);
+int pkgdb_get(const char *name, Package *out);
+int pkgdb_put(const Package *pkg);
+int pkgdb_del(const char *name);
+int pkgdb_commit(void);
+int pathidx_open(void);
+const char* pathidx_owner(const char *path);
+void pathidx_set(const char *path, const char *owner);
+int pathidx_clear(const char *path, const char *owner);
+int pathidx_take(const char *path, const char *owner, char *holder, size_t len);
+int pathidx_sync(void);
+int txn_begin(const char *op);
+int txn_commit(void);
+static long history_last(void);
+static void history_record(const char *op);
+static int journal_recover(void);
+Package* read_package_info(const char *archive_path);
+int check_dependencies(const char *depends);
+int download_package(const char *package_name);
+int download_start(DownloadBatch *b);
+int download_wait(DownloadBatch *b, int i);
+void download_finish(DownloadBatch *b);
+static int copy_data(struct archive *ar, struct archive *aw, EVP_MD_CTX *md, uint64_t *len);
+int check_conflicts(const char *package_name, const char *path, int *fresh);
+int extract_package(const char *package_name);
+Package* unpack_package(struct archive *a, const char *package_name, int flags, Stream *src);
+
+#define UNPACK_DEPS 1   /* refuse if PKGINFO depends aren't installed */
+#define UNPACK_SHOW 2   /* print PKGINFO */
+void log_action(const char *action, const char *package_name, int status);
+int mark_installed(const char *package_name, Package *pkg);
+Package* read_installed_package(const char *package_name);
+int repo_compile(void);
+int repo_open(void);
+int repo_load(void);
+const RepoEntry* repo_find(const char *name);
+int search_build(void);
+int install_package(const char *package_name);
+static int install_downloaded(const char *package_name, int update, uint32_t flags);
+static int install_from(struct archive *a, const char *package_name, int update, uint32_t flags, Stream *src);
+static int install_level(const char **names, const uint32_t *flags, int *failed, int n, int update);
+int vercmp(const char *a, const char *b);
+int remove_package(const char *package_name);
+static void make_parents(const char *path);
+
+
+int read_config(void) {
+    /* MPKG_CONFIG points at another config, e.g. for a scratch root */
+    const char *conf = getenv("MPKG_CONFIG");
+    FILE *f = fopen(conf && *conf ? conf : CONFIG_FILE, "r");
+    if (!f) return 0;
+    char line[2048];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (line[0] == '#' || line[0] == '\0') continue;
+        char *key = strtok(line, "=");
+        char *value = strtok(NULL, "=");
+        if (!key || !value) continue;
+        while (*key == ' ') key++;
+        while (*value == ' ') value++;
+        char *end = value + strlen(value) - 1;
+        while (end > value && *end == ' ') *end-- = '\0';
+        if (strcmp(key, "PKG_DB_PATH") == 0) strncpy(PKG_DB_PATH, value, sizeof(PKG_DB_PATH)-1);
+        else if (strcmp(key, "PKG_CACHE_PATH") == 0) strncpy(PKG_CACHE_PATH, value, sizeof(PKG_CACHE_PATH)-1);
+        else if (strcmp(key, "PKG_REPO_URL") == 0) strncpy(PKG_REPO_URL, value, sizeof(PKG_REPO_URL)-1);
+        else if (strcmp(key, "PKG_PARALLEL_DOWNLOADS") == 0) PKG_PARALLEL_DOWNLOADS = atoi(value) > 0 ? atoi(value) : 1;
+        else if (strcmp(key, "PKG_STREAM_INSTALL") == 0) PKG_STREAM_INSTALL = atoi(value);
+        else if (strcmp(key, "PKG_KEEP_CACHE") == 0) PKG_KEEP_CACHE = atoi(value);
+        else if (strcmp(key, "PKG_DECODE_THREADS") == 0) PKG_DECODE_THREADS = atoi(value);
+        else if (strcmp(key, "PKG_VERBOSE") == 0) PKG_VERBOSE = atoi(value);
+        else if (strcmp(key, "PKG_FILE_STORE") == 0) PKG_FILE_STORE = atoi(value);
+    }
+    fclose(f);
+    return 0;
+}
+
+/* the config, then --root and --dbpath on top of it */
+static int db_paths(void) {
+    if (read_config() != 0) return -1;
+    if (*PKG_ROOT) {
+        char real[PATH_MAX];
+        if (!realpath(PKG_ROOT, real)) { fprintf(stderr, "%s: %s\n", PKG_ROOT, strerror(errno)); return -1; }
+        if (snprintf(PKG_ROOT, sizeof(PKG_ROOT), "%s", strcmp(real, "/") ? real : "") >= (int)sizeof(PKG_ROOT) ||
+            (!*PKG_ROOT_DB && snprintf(PKG_ROOT_DB, sizeof(PKG_ROOT_DB), "%s%s", PKG_ROOT, PKG_DB_PATH) >= (int)sizeof(PKG_ROOT_DB))) {
+            fprintf(stderr, "%s: %s\n", real, strerror(errno = ENAMETOOLONG));
+            return -1;
+        }
+        if (*PKG_ROOT && root_fd < 0 && (root_fd = open(PKG_ROOT, O_PATH|O_DIRECTORY|O_CLOEXEC)) < 0) {
+            fprintf(stderr, "%s: %s\n", PKG_ROOT, strerror(errno));
+            return -1;
+        }
+    }
+    if (*PKG_ROOT_DB && snprintf(PKG_DB_PATH, sizeof(PKG_DB_PATH), "%s", PKG_ROOT_DB) >= (int)sizeof(PKG_DB_PATH)) {
+        fprintf(stderr, "%s: %s\n", PKG_ROOT_DB, strerror(errno = ENAMETOOLONG));
+        return -1;
+    }
+    return 0;
+}
+
+/* Take JOURNAL_LOCK, waiting for whoever has it if wait is set. */
+static int txn_lock(int wait) {
+    if (txn.lockfd >= 0) return 0;
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, JOURNAL_LOCK);
+    int fd = open(path, O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    if (flock(fd, LOCK_EX|LOCK_NB)) {
+        if (!wait || errno != EWOULDBLOCK) { close(fd); return -1; }
+        printf("Waiting for another mpkg to finish\n");
+        fflush(stdout);
+        if (flock(fd, LOCK_EX)) { close(fd); return -1; }
+    }
+    txn.lockfd = fd;
+    return 0;
+}
+
+static void txn_unlock(void) {
+    if (txn.lockfd >= 0) close(txn.lockfd);
+    txn.lockfd = -1;
+}
+
+int db_init(void) {
+    if (db_paths()) return -1;
+    if (*PKG_ROOT_DB) {
+        char db[512];
+        snprintf(db, sizeof(db), "%s/%s", PKG_DB_PATH, PKGDB_FILE);
+        make_parents(db);
+    }
+    mkdir(PKG_DB_PATH, 0755);
+    mkdir(PKG_CACHE_PATH, 0755);
+    char blobs[512];
+    snprintf(blobs, sizeof(blobs), "%s/blobs", PKG_CACHE_PATH);
+    mkdir(blobs, 0755);
+    if (PKG_FILE_STORE) {
+        snprintf(blobs, sizeof(blobs), "%s/%s", PKG_CACHE_PATH, STORE_DIR);
+        mkdir(blobs, 0755);
+    }
+    snprintf(blobs, sizeof(blobs), "%s/%s", PKG_DB_PATH, HISTORY_DIR);
+    mkdir(blobs, 0755);
+    if (pkgdb_open()) return -1;
+    /* a journal someone holds belongs to a transaction still running;
+       the next writer recovers it if that one dies */
+    char path[512];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, JOURNAL_FILE);
+    if (stat(path, &st) || !st.st_size || txn_lock(0)) return 0;
+    int r = journal_recover();
+    txn_unlock();
+    return r;
+}
+
+int is_installed(const char *package_name) {
+    return pkgdb_get(package_name, NULL);
+}
+
+static void pkgdb_unmap(void) {
+    if (db.map) munmap(db.map, db.len);
+    db.map = NULL; db.len = 0;
+    db.hdr = NULL; db.rec = NULL; db.str = NULL;
+    db.dep_off = db.dep = db.rdep_off = db.rdep = NULL;
+}
+
+static int pkgdb_map(void) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, PKGDB_FILE);
+    pkgdb_unmap();
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 1 : -1;
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(DbHeader)) { close(fd); return -1; }
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+    const DbHeader *h = m;
+    if (memcmp(h->magic, PKGDB_MAGIC, 8) ||
+        sizeof(DbHeader) + (uint64_t)h->count * sizeof(DbRecord) > h->strings ||
+        h->strings + h->strings_len > (uint64_t)st.st_size) {
+        munmap(m, st.st_size);
+        fprintf(stderr, "Corrupt package database %s\n", path);
+        return -1;
+    }
+    db.map = m; db.len = st.st_size; db.hdr = h;
+    db.rec = (const DbRecord *)(h + 1);
+    db.str = (const char *)m + h->strings;
+    uint64_t g = (h->strings + h->strings_len + 7) & ~7ULL, n = h->count + 1;
+    if (h->version < 2 || g + sizeof(DbGraph) > (uint64_t)st.st_size) return 0;
+    const DbGraph *dg = (const DbGraph *)((char *)m + g);
+    if (g + sizeof(DbGraph) + (2 * n + 2 * (uint64_t)dg->nedges) * 4 > (uint64_t)st.st_size) return 0;
+    db.dep_off = (const uint32_t *)(dg + 1);
+    db.dep = db.dep_off + n;
+    db.rdep_off = db.dep + dg->nedges;
+    db.rdep = db.rdep_off + n;
+    return 0;
+}
+
+static Package* read_legacy_package(const char *path);
+
+/* one-time import of the old <name>.installed files */
+static int pkgdb_migrate(void) {
+    DIR *d = opendir(PKG_DB_PATH);
+    if (!d) return -1;
+    struct dirent *e;
+    int n = 0;
+    while ((e = readdir(d))) {
+        char *suf = strstr(e->d_name, ".installed");
+        if (!suf || suf[10]) continue;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, e->d_name);
+        Package *p = read_legacy_package(path);
+        if (!p) continue;
+        if (!*p->name) snprintf(p->name, sizeof(p->name), "%.*s", (int)(suf - e->d_name), e->d_name);
+        pkgdb_put(p);
+        free(p);
+        n++;
+    }
+    if (pkgdb_commit()) { closedir(d); return -1; }
+    rewinddir(d);
+    while ((e = readdir(d))) {
+        char *suf = strstr(e->d_name, ".installed");
+        if (!suf || suf[10]) continue;
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, e->d_name);
+        unlink(path);
+    }
+    closedir(d);
+    if (n) printf("Migrated %d packages to %s\n", n, PKGDB_FILE);
+    return 0;
+}
+
+int pkgdb_open(void) {
+    int r = pkgdb_map();
+    if (r > 0) return pkgdb_migrate();
+    /* an older file gets its graph on the first write; do that now */
+    if (!r && db.hdr && !db.dep_off && !access(PKG_DB_PATH, W_OK)) pkgdb_commit();
+    return r;
+}
+
+static int rec_cmp(const char *name, const DbRecord *r) {
+    return strcmp(name, DB_STR(r->name));
+}
+
+static const DbRecord* pkgdb_lookup(const char *name) {
+    if (!db.hdr) return NULL;
+    size_t lo = 0, hi = db.hdr->count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        int c = rec_cmp(name, &db.rec[mid]);
+        if (!c) return &db.rec[mid];
+        if (c < 0) hi = mid; else lo = mid + 1;
+    }
+    return NULL;
+}
+
+static DbChange* pkgdb_pending(const char *name) {
+    for (int i = db.npending - 1; i >= 0; i--)
+        if (!strcmp(db.pending[i].pkg.name, name)) return &db.pending[i];
+    return NULL;
+}
+
+static void record_to_package(const DbRecord *r, Package *p) {
+    memset(p, 0, sizeof(*p));
+    strncpy(p->name, DB_STR(r->name), sizeof(p->name)-1);
+    strncpy(p->version, DB_STR(r->version), sizeof(p->version)-1);
+    strncpy(p->arch, DB_STR(r->arch), sizeof(p->arch)-1);
+    strncpy(p->description, DB_STR(r->description), sizeof(p->description)-1);
+    strncpy(p->depends, DB_STR(r->depends), sizeof(p->depends)-1);
+    p->size = r->size;
+    p->install_time = r->install_time;
+    p->flags = r->flags & DB_AUTO;
+}
+
+/* staged changes shadow the mapped file until committed */
+int pkgdb_get(const char *name, Package *out) {
+    pthread_mutex_lock(&db.lock);
+    DbChange *c = pkgdb_pending(name);
+    int found;
+    if (c) {
+        if (!c->del && out) *out = c->pkg;
+        found = !c->del;
+    } else {
+        const DbRecord *r = pkgdb_lookup(name);
+        if (r && out) record_to_package(r, out);
+        found = r != NULL;
+    }
+    pthread_mutex_unlock(&db.lock);
+    return found;
+}
+
+static DbChange* pkgdb_stage(const char *name) {
+    DbChange *c = pkgdb_pending(name);
+    if (c) return c;
+    if (db.npending == db.cap) {
+        db.cap = db.cap ? db.cap * 2 : 16;
+        db.pending = realloc(db.pending, db.cap * sizeof(DbChange));
+    }
+    c = &db.pending[db.npending++];
+    memset(c, 0, sizeof(*c));
+    strncpy(c->pkg.name, name, sizeof(c->pkg.name)-1);
+    return c;
+}
+
+int pkgdb_put(const Package *pkg) {
+    pthread_mutex_lock(&db.lock);
+    DbChange *c = pkgdb_stage(pkg->name);
+    c->pkg = *pkg;
+    c->del = 0;
+    pthread_mutex_unlock(&db.lock);
+    return 0;
+}
+
+int pkgdb_del(const char *name) {
+    pthread_mutex_lock(&db.lock);
+    pkgdb_stage(name)->del = 1;
+    pthread_mutex_unlock(&db.lock);
+    return 0;
+}
+
+static int change_cmp(const void *a, const void *b) {
+    return strcmp(((const DbChange *)a)->pkg.name, ((const DbChange *)b)->pkg.name);
+}
+
+typedef struct {
+    char *buf;
+    size_t len, cap;
+} StrPool;
+
+static uint32_t pool_add(StrPool *sp, const char *s) {
+    if (!*s) return 0;
+    size_t n = strlen(s) + 1;
+    while (sp->len + n > sp->cap) {
+        sp->cap = sp->cap ? sp->cap * 2 : 4096;
+        sp->buf = realloc(sp->buf, sp->cap);
+    }
+    memcpy(sp->buf + sp->len, s, n);
+    sp->len += n;
+    return sp->len - n;
+}
+
+static void pool_record(StrPool *sp, DbRecord *out, const Package *p) {
+    memset(out, 0, sizeof(*out));
+    out->name = pool_add(sp, p->name);
+    out->version = pool_add(sp, p->version);
+    out->arch = pool_add(sp, p->arch);
+    out->description = pool_add(sp, p->description);
+    out->depends = pool_add(sp, p->depends);
+    out->size = p->size;
+    out->install_time = p->install_time;
+    out->flags = p->flags & DB_AUTO;
+}
+
+typedef struct {
+    uint64_t *hash;
+    uint32_t *off;
+    uint32_t n, used;
+} InternTab;
+
+static uint64_t path_hash(const char *s);
+
+/* pool_add() that returns the existing offset for repeated strings */
+static uint32_t pool_intern(StrPool *sp, InternTab *t, const char *s) {
+    if (!*s) return 0;
+    if ((t->used + 1) * 2 > t->n) {
+        uint32_t n = t->n ? t->n * 2 : 256;
+        uint64_t *hash = calloc(n, sizeof(uint64_t));
+        uint32_t *off = calloc(n, sizeof(uint32_t));
+        for (uint32_t i = 0; i < t->n; i++) {
+            if (!t->off[i]) continue;
+            uint32_t j;
+            for (j = t->hash[i] & (n - 1); off[j]; j = (j + 1) & (n - 1));
+            hash[j] = t->hash[i]; off[j] = t->off[i];
+        }
+        free(t->hash); free(t->off);
+        t->hash = hash; t->off = off; t->n = n;
+    }
+    uint64_t h = path_hash(s);
+    uint32_t j;
+    for (j = h & (t->n - 1); t->off[j]; j = (j + 1) & (t->n - 1))
+        if (t->hash[j] == h && !strcmp(sp->buf + t->off[j], s)) return t->off[j];
+    t->hash[j] = h;
+    t->off[j] = pool_add(sp, s);
+    t->used++;
+    return t->off[j];
+}
+
+static void intern_free(InternTab *t) {
+    free(t->hash); free(t->off);
+    memset(t, 0, sizeof(*t));
+}
+
+static int pkgdb_write(void);
+static int dep_next(const char **cur, char *out, size_t len);
+
+/* Merge staged changes into the current file and swap it in with rename(),
+   so readers only ever see a complete database. */
+int pkgdb_commit(void) {
+    pthread_mutex_lock(&db.lock);
+    int r = pkgdb_write();
+    pthread_mutex_unlock(&db.lock);
+    return r;
+}
+
+static int64_t graph_find_record(const DbRecord *rec, uint32_t n, const char *str, const char *name) {
+    uint32_t lo = 0, hi = n;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(name, str + rec[mid].name);
+        if (!c) return mid;
+        if (c < 0) hi = mid; else lo = mid + 1;
+    }
+    return -1;
+}
+
+/* Depends edges of the merged records. A record carried over unchanged
+   keeps its old edges, renumbered through renum[]; only changed ones,
+   and ones whose dependency was missing, have depends= parsed again.
+   The reverse table is then one counting pass over the edges. */
+static void graph_build(DbRecord *rec, uint32_t n, const char *str, const int64_t *from, const uint32_t *renum,
+                        uint32_t *dep_off, uint32_t **dep, uint32_t *rdep_off, uint32_t **rdep) {
+    uint32_t ne = 0, cap = 1024;
+    uint32_t *e = malloc(cap * sizeof(uint32_t));
+    for (uint32_t k = 0; k < n; k++) {
+        dep_off[k] = ne;
+        rec[k].flags &= ~DB_DANGLING;
+        int64_t i = from[k];
+        int carry = i >= 0 && db.dep_off && !(db.rec[i].flags & DB_DANGLING);
+        for (uint32_t j = carry ? db.dep_off[i] : 0; carry && j < db.dep_off[i + 1]; j++) {
+            if (ne == cap) e = realloc(e, (cap *= 2) * sizeof(uint32_t));
+            if (renum[db.dep[j]] == UINT32_MAX) rec[k].flags |= DB_DANGLING;
+            else e[ne++] = renum[db.dep[j]];
+        }
+        if (carry) continue;
+        const char *cur = str + rec[k].depends;
+        char name[256];
+        while (dep_next(&cur, name, sizeof(name))) {
+            int64_t t = graph_find_record(rec, n, str, name);
+            if (t < 0) { rec[k].flags |= DB_DANGLING; continue; }
+            if (ne == cap) e = realloc(e, (cap *= 2) * sizeof(uint32_t));
+            e[ne++] = t;
+        }
+    }
+    dep_off[n] = ne;
+    uint32_t *r = malloc((ne + 1) * sizeof(uint32_t)), *at = calloc(n + 1, sizeof(uint32_t));
+    memset(rdep_off, 0, (n + 1) * sizeof(uint32_t));
+    for (uint32_t j = 0; j < ne; j++) rdep_off[e[j] + 1]++;
+    for (uint32_t k = 0; k < n; k++) rdep_off[k + 1] += rdep_off[k];
+    memcpy(at, rdep_off, n * sizeof(uint32_t));
+    for (uint32_t k = 0; k < n; k++)
+        for (uint32_t j = dep_off[k]; j < dep_off[k + 1]; j++) r[at[e[j]]++] = k;
+    free(at);
+    *dep = e; *rdep = r;
+}
+
+static int pkgdb_write(void) {
+    char path[512], tmp[512], lock[512];
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, PKGDB_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    snprintf(lock, sizeof(lock), "%s.lock", path);
+    int lfd = open(lock, O_RDWR|O_CREAT, 0644);
+    if (lfd < 0 || flock(lfd, LOCK_EX)) { if (lfd >= 0) close(lfd); return -1; }
+    if (pkgdb_map() < 0) { close(lfd); return -1; }
+    qsort(db.pending, db.npending, sizeof(DbChange), change_cmp);
+
+    uint32_t old = db.hdr ? db.hdr->count : 0;
+    DbRecord *out = malloc((old + db.npending + 1) * sizeof(DbRecord));
+    int64_t *from = malloc((old + db.npending + 1) * sizeof(int64_t));     /* old record, -1 if changed */
+    uint32_t *renum = malloc((old + 1) * sizeof(uint32_t));                /* old -> new record */
+    StrPool sp = { calloc(1, 4096), 1, 4096 };
+    uint32_t n = 0, i = 0;
+    int j = 0;
+    Package p;
+    while (i < old || j < db.npending) {
+        int c = i >= old ? 1 : j >= db.npending ? -1 : strcmp(DB_STR(db.rec[i].name), db.pending[j].pkg.name);
+        if (c < 0) {
+            renum[i] = n;
+            from[n] = i;
+            record_to_package(&db.rec[i++], &p);
+            pool_record(&sp, &out[n++], &p);
+            continue;
+        }
+        if (c == 0) renum[i++] = db.pending[j].del ? UINT32_MAX : n;
+        if (!db.pending[j].del) { from[n] = -1; pool_record(&sp, &out[n++], &db.pending[j].pkg); }
+        j++;
+    }
+    uint32_t *dep_off = malloc((n + 1) * sizeof(uint32_t)), *rdep_off = malloc((n + 1) * sizeof(uint32_t)), *dep, *rdep;
+    graph_build(out, n, sp.buf, from, renum, dep_off, &dep, rdep_off, &rdep);
+
+    DbHeader h = {0};
+    memcpy(h.magic, PKGDB_MAGIC, 8);
+    h.version = PKGDB_VERSION;
+    h.count = n;
+    h.strings = sizeof(h) + (uint64_t)n * sizeof(DbRecord);
+    h.strings_len = sp.len;
+    DbGraph g = { dep_off[n], 0 };
+    static const char pad[8];
+    size_t npad = -(h.strings + sp.len) & 7;
+    int fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    int err = fd < 0;
+    if (!err) {
+        FILE *f = fdopen(fd, "w");
+        err = fwrite(&h, sizeof(h), 1, f) != 1 ||
+              (n && fwrite(out, sizeof(DbRecord), n, f) != n) ||
+              fwrite(sp.buf, 1, sp.len, f) != sp.len ||
+              fwrite(pad, 1, npad, f) != npad || fwrite(&g, sizeof(g), 1, f) != 1 ||
+              fwrite(dep_off, sizeof(uint32_t), n + 1, f) != n + 1 ||
+              fwrite(dep, sizeof(uint32_t), g.nedges, f) != g.nedges ||
+              fwrite(rdep_off, sizeof(uint32_t), n + 1, f) != n + 1 ||
+              fwrite(rdep, sizeof(uint32_t), g.nedges, f) != g.nedges ||
+              fflush(f) || fsync(fd);
+        fclose(f);
+        if (!err) err = rename(tmp, path) != 0;
+        if (err) unlink(tmp);
+    }
+    free(out); free(sp.buf); free(from); free(renum);
+    free(dep_off); free(dep); free(rdep_off); free(rdep);
+    if (!err) db.npending = 0;
+    if (pkgdb_map() < 0) err = 1;
+    close(lfd);
+    if (err) fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+    return err ? -1 : 0;
+}
+
+
+/* Phase timing for --timings and --trace. Each span charges its wall and
+   CPU time, bytes and files to a phase; --timings prints the totals and
+   --trace writes every span as a Chrome trace event (chrome://tracing,
+   Perfetto). Spans cost nothing while both are off. */
+enum { PH_DOWNLOAD, PH_DELTA, PH_DECODE, PH_PKGINFO, PH_CONFLICTS, PH_EXTRACT, PH_DB, PH_COMMIT, PH_MAX };
+static const char *phase_name[PH_MAX] = {
+    "download", "delta", "decode", "pkginfo", "conflicts", "extract", "db", "commit"
+};
+
+typedef struct {
+    double wall, cpu;
+    uint64_t bytes, files, count;
+} PhaseStat;
+
+static struct {
+    int on, summary;
+    FILE *trace;
+    int events;
+    double t0;
+    PhaseStat ph[PH_MAX];
+    pthread_mutex_t lock;
+} timing = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+typedef struct {
+    double wall, cpu;
+} Span;
+
+static double clock_sec(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void span_begin(Span *s) {
+    if (!timing.on) return;
+    s->wall = clock_sec(CLOCK_MONOTONIC);
+    s->cpu = clock_sec(CLOCK_THREAD_CPUTIME_ID);
+}
+
+/* add the time since span_begin to *acc, for work split over many calls */
+static void span_lap(const Span *s, Span *acc) {
+    if (!timing.on) return;
+    acc->wall += clock_sec(CLOCK_MONOTONIC) - s->wall;
+    acc->cpu += clock_sec(CLOCK_THREAD_CPUTIME_ID) - s->cpu;
+}
+
+static void trace_str(FILE *f, const char *s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        if ((unsigned char)*s >= 0x20) fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+/* charge wall/cpu seconds that began at start to phase ph */
+static void timing_add(int ph, const char *what, double start, double wall, double cpu,
+                       uint64_t bytes, uint64_t files) {
+    if (!timing.on) return;
+    pthread_mutex_lock(&timing.lock);
+    PhaseStat *p = &timing.ph[ph];
+    p->wall += wall; p->cpu += cpu;
+    p->bytes += bytes; p->files += files;
+    p->count++;
+    if (timing.trace) {
+        FILE *f = timing.trace;
+        fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"mpkg\",\"ph\":\"X\",\"ts\":%.0f,\"dur\":%.0f,\"pid\":%d,\"tid\":%ld,\"args\":{\"pkg\":",
+                timing.events++ ? ",\n" : "", phase_name[ph], (start - timing.t0) * 1e6, wall * 1e6,
+                (int)getpid(), (long)syscall(SYS_gettid));
+        trace_str(f, what);
+        fprintf(f, ",\"cpu_us\":%.0f,\"bytes\":%llu,\"files\":%llu}}", cpu * 1e6,
+                (unsigned long long)bytes, (unsigned long long)files);
+    }
+    pthread_mutex_unlock(&timing.lock);
+}
+
+static void span_end(const Span *s, int ph, const char *what, uint64_t bytes, uint64_t files) {
+    if (!timing.on) return;
+    timing_add(ph, what, s->wall, clock_sec(CLOCK_MONOTONIC) - s->wall,
+               clock_sec(CLOCK_THREAD_CPUTIME_ID) - s->cpu, bytes, files);
+}
+
+/* Phases run on several threads at once, so their wall times can add
+   up to more than the total. */
+static void timing_report(void) {
+    if (timing.trace) {
+        fprintf(timing.trace, "\n]\n");
+        if (fclose(timing.trace)) fprintf(stderr, "Can't write trace: %s\n", strerror(errno));
+        timing.trace = NULL;
+    }
+    if (!timing.summary) return;
+    fprintf(stderr, "\n%-10s %7s %10s %10s %14s %9s\n", "phase", "count", "wall s", "cpu s", "bytes", "files");
+    for (int i = 0; i < PH_MAX; i++) {
+        PhaseStat *p = &timing.ph[i];
+        if (!p->count) continue;
+        fprintf(stderr, "%-10s %7llu %10.3f %10.3f %14llu %9llu\n", phase_name[i],
+                (unsigned long long)p->count, p->wall, p->cpu,
+                (unsigned long long)p->bytes, (unsigned long long)p->files);
+    }
+    fprintf(stderr, "%-10s %7s %10.3f %10.3f\n", "total", "",
+            clock_sec(CLOCK_MONOTONIC) - timing.t0, clock_sec(CLOCK_PROCESS_CPUTIME_ID));
+}
+
+/* timings: print the table at exit; trace: write events to this file */
+int timing_start(int summary, const char *trace) {
+    timing.t0 = clock_sec(CLOCK_MONOTONIC);
+    timing.summary = summary;
+    if (trace) {
+        timing.trace = fopen(trace, "w");
+        if (!timing.trace) { fprintf(stderr, "Can't open %s: %s\n", trace, strerror(errno)); return -1; }
+        fprintf(timing.trace, "[\n");
+    }
+    timing.on = summary || trace;
+    if (timing.on) atexit(timing_report);
+    return 0;
+}
+
+static uint64_t path_hash(const char *s) {
+    uint64_t h = 1469598103934665603ULL;
+    while (*s) { h ^= (unsigned char)*s++; h *= 1099511628211ULL; }
+    return h ? h : 1;
+}
+
+static void path_list_add(PathList *pl, const char *path) {
+    if (pl->n == pl->cap) {
+        pl->cap = pl->cap ? pl->cap * 2 : 64;
+        pl->v = realloc(pl->v, pl->cap * sizeof(char *));
+    }
+    pl->v[pl->n++] = strdup(path);
+}
+
+static void path_list_free(PathList *pl) {
+    for (int i = 0; i < pl->n; i++) free(pl->v[i]);
+    free(pl->v);
+    memset(pl, 0, sizeof(*pl));
+}
+
+/* archive member name -> absolute path as recorded in .files */
+static void abs_path(const char *name, char *out, size_t len) {
+    if (!strncmp(name, "./", 2)) name++;
+    snprintf(out, len, name[0] == '/' ? "%s" : "/%s", name);
+}
+
+static int has_dotdot(const char *p) {
+    for (const char *c = p; (c = strstr(c, "..")); c += 2)
+        if ((c == p || c[-1] == '/') && (!c[2] || c[2] == '/')) return 1;
+    return 0;
+}
+
+/* Where a package path is on disk. Manifests, the path index and the
+   journal keep paths as seen from inside the tree, so an image built
+   with --root can manage itself once booted. Under --root the deepest
+   existing directory is resolved with RESOLVE_IN_ROOT, so a symlink an
+   earlier package left in the image (etc -> /etc) is followed inside
+   it, not on the host. NULL for a path with ".." in it, or one that
+   can't be resolved inside the root. */
+static const char* root_path(const char *path, char *out, size_t len) {
+    if (has_dotdot(path)) { errno = EPERM; return NULL; }
+    if (!*PKG_ROOT) return path;
+    char dir[1024], real[PATH_MAX], proc[64];
+    if (snprintf(dir, sizeof(dir), "%s", path) >= (int)sizeof(dir)) { errno = ENAMETOOLONG; return NULL; }
+    char *tail = strrchr(dir, '/');
+    if (!tail) { errno = EINVAL; return NULL; }
+    struct open_how how = { .flags = O_PATH | O_DIRECTORY | O_CLOEXEC, .resolve = RESOLVE_IN_ROOT };
+    int fd;
+    /* directories that don't exist yet can't be links; the rest of the
+       path is made below the deepest one that does */
+    for (;;) {
+        *tail = 0;
+        fd = syscall(SYS_openat2, root_fd, *dir ? dir : "/", &how, sizeof(how));
+        if (fd >= 0 || errno != ENOENT || tail == dir) break;
+        *tail = '/';
+        while (--tail > dir && *tail != '/');
+    }
+    if (fd < 0) return NULL;
+    snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+    ssize_t n = readlink(proc, real, sizeof(real) - 1);
+    close(fd);
+    if (n < 0) return NULL;
+    real[n] = 0;
+    size_t lr = strlen(PKG_ROOT);
+    if (strncmp(real, PKG_ROOT, lr) || (real[lr] && real[lr] != '/')) { errno = EXDEV; return NULL; }
+    if (snprintf(out, len, "%s%s", !strcmp(real, "/") ? "" : real, path + (tail - dir)) >= (int)len) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    return out;
+}
+
+/* finish a sha256 as lowercase hex */
+static void digest_hex(EVP_MD_CTX *md, char *hex) {
+    unsigned char d[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    EVP_DigestFinal_ex(md, d, &len);
+    for (unsigned int i = 0; i < len; i++) sprintf(hex + 2*i, "%02x", d[i]);
+    hex[2*len] = 0;
+}
+
+/* A .files line is the absolute path, followed for regular files by
+   size, octal mode, mtime and sha256, tab-separated. Lists written by
+   older versions have the path alone. Directories the package created
+   are listed with a trailing slash, so remove can prune them. */
+#define MANIFEST_LINE 1280
+
+typedef struct {
+    const char *path;
+    uint64_t size;
+    unsigned mode;
+    int64_t mtime;
+    const char *sha256;     /* NULL: no metadata recorded */
+} FileMeta;
+
+/* split a .files line in place, leaving just the path in line */
+static void manifest_split(char *line, FileMeta *m) {
+    char *tab = strchr(line, '\t');
+    if (tab) *tab++ = 0;
+    if (!m) return;
+    memset(m, 0, sizeof(*m));
+    m->path = line;
+    if (!tab) return;
+    char *end;
+    m->size = strtoull(tab, &end, 10);
+    m->mode = strtoul(end, &end, 8);
+    m->mtime = strtoll(end, &end, 10);
+    if (*end == '\t' && strlen(end + 1) == 64) m->sha256 = end + 1;
+}
+
+static int is_dir_entry(const char *path) {
+    size_t n = strlen(path);
+    return n && path[n-1] == '/';
+}
+
+/* next entry of a .files list; NULL at the end */
+static const char* manifest_next(FILE *f, char *line, FileMeta *m) {
+    while (fgets(line, MANIFEST_LINE, f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (!*line) continue;
+        manifest_split(line, m);
+        return line;
+    }
+    return NULL;
+}
+
+static PathChange* overlay_slot(const char *path, uint64_t h) {
+    if (!pidx.ovslots) return NULL;
+    uint32_t mask = pidx.ovslots - 1;
+    for (uint32_t i = h & mask;; i = (i + 1) & mask) {
+        PathChange *c = &pidx.ov[i];
+        if (!c->path || (c->hash == h && !strcmp(c->path, path))) return c;
+    }
+}
+
+static void overlay_put(const char *path, const char *owner) {
+    if ((pidx.ovused + 1) * 2 > pidx.ovslots) {
+        uint32_t n = pidx.ovslots ? pidx.ovslots * 2 : 1024;
+        PathChange *old = pidx.ov;
+        uint32_t oldn = pidx.ovslots;
+        pidx.ov = calloc(n, sizeof(PathChange));
+        pidx.ovslots = n;
+        for (uint32_t i = 0; i < oldn; i++)
+            if (old[i].path) *overlay_slot(old[i].path, old[i].hash) = old[i];
+        free(old);
+    }
+    uint64_t h = path_hash(path);
+    PathChange *c = overlay_slot(path, h);
+    if (!c->path) { c->path = strdup(path); c->hash = h; pidx.ovused++; }
+    free(c->owner);
+    c->owner = owner ? strdup(owner) : NULL;
+}
+
+static void overlay_free(void) {
+    for (uint32_t i = 0; i < pidx.ovslots; i++) { free(pidx.ov[i].path); free(pidx.ov[i].owner); }
+    free(pidx.ov);
+    pidx.ov = NULL; pidx.ovslots = pidx.ovused = 0;
+}
+
+static const char* base_owner(const char *path, uint64_t h) {
+    if (!pidx.hdr || !pidx.hdr->nslots) return NULL;
+    uint32_t mask = pidx.hdr->nslots - 1;
+    for (uint32_t i = h & mask;; i = (i + 1) & mask) {
+        const PathSlot *s = &pidx.slot[i];
+        if (!s->path) return NULL;
+        if (s->hash == h && !strcmp(pidx.str + s->path, path)) return pidx.str + s->owner;
+    }
+}
+
+static const char* owner_of(const char *path) {
+    uint64_t h = path_hash(path);
+    PathChange *c = overlay_slot(path, h);
+    if (c && c->path) return c->owner;
+    return base_owner(path, h);
+}
+
+/* the result stays valid until the index is next modified */
+const char* pathidx_owner(const char *path) {
+    pthread_mutex_lock(&pidx.lock);
+    const char *o = owner_of(path);
+    pthread_mutex_unlock(&pidx.lock);
+    return o;
+}
+
+static int pathidx_map(void) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, PATHIDX_FILE);
+    if (pidx.map) munmap(pidx.map, pidx.len);
+    pidx.map = NULL; pidx.hdr = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return errno == ENOENT ? 1 : -1;
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(PathIdxHeader)) { close(fd); return -1; }
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+    const PathIdxHeader *h = m;
+    if (memcmp(h->magic, PATHIDX_MAGIC, 8) || (h->nslots & (h->nslots - 1)) ||
+        h->strings + h->strings_len > (uint64_t)st.st_size) {
+        munmap(m, st.st_size);
+        return -1;
+    }
+    pidx.map = m; pidx.len = st.st_size; pidx.hdr = h;
+    pidx.slot = (const PathSlot *)(h + 1);
+    pidx.str = (const char *)m + h->strings;
+    return 0;
+}
+
+static void pathidx_replay(void) {
+    char path[512], line[2048];
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, PATHLOG_FILE);
+    FILE *f = fopen(path, "r");
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        size_t n = strcspn(line, "\n");
+        if (!line[n]) break;    /* torn tail from an interrupted write */
+        line[n] = 0;
+        char *tab = strchr(line, '\t');
+        if (line[0] == '+' && tab) { *tab = 0; overlay_put(tab + 1, line + 1); }
+        else if (line[0] == '-') overlay_put(line + 1, NULL);
+    }
+    fclose(f);
+}
+
+/* Fold base table and overlay into a new table at most half full. */
+static int pathidx_rebuild(void) {
+    uint64_t live = 0;
+    uint32_t nb = pidx.hdr ? pidx.hdr->nslots : 0;
+    for (uint32_t i = 0; i < nb; i++) if (pidx.slot[i].path) live++;
+    live += pidx.ovused;
+    uint32_t nslots = 1024;
+    while (nslots < live * 2) nslots *= 2;
+    PathSlot *slots = calloc(nslots, sizeof(PathSlot));
+    StrPool sp = { calloc(1, 4096), 1, 4096 };
+    InternTab owners = {0};
+    uint64_t count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        uint32_t n = pass ? pidx.ovslots : nb;
+        for (uint32_t i = 0; i < n; i++) {
+            const char *path, *owner;
+            uint64_t h;
+            if (pass) {
+                if (!pidx.ov[i].path || !pidx.ov[i].owner) continue;
+                path = pidx.ov[i].path; owner = pidx.ov[i].owner; h = pidx.ov[i].hash;
+            } else {
+                if (!pidx.slot[i].path) continue;
+                path = pidx.str + pidx.slot[i].path; h = pidx.slot[i].hash;
+                PathChange *c = overlay_slot(path, h);
+                if (c && c->path) continue;
+                owner = pidx.str + pidx.slot[i].owner;
+            }
+            /* owners repeat for every file of a package */
+            uint32_t oo = pool_intern(&sp, &owners, owner);
+            uint32_t j;
+            for (j = h & (nslots - 1); slots[j].path; j = (j + 1) & (nslots - 1));
+            slots[j].hash = h;
+            slots[j].path = pool_add(&sp, path);
+            slots[j].owner = oo;
+            count++;
+        }
+    }
+    intern_free(&owners);
+
+    char path[512], tmp[512], logp[512];
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, PATHIDX_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    snprintf(logp, sizeof(logp), "%s/%s", PKG_DB_PATH, PATHLOG_FILE);
+    PathIdxHeader h = {0};
+    memcpy(h.magic, PATHIDX_MAGIC, 8);
+    h.version = 1;
+    h.nslots = nslots;
+    h.count = count;
+    h.strings = sizeof(h) + (uint64_t)nslots * sizeof(PathSlot);
+    h.strings_len = sp.len;
+    FILE *f = fopen(tmp, "w");
+    int err = !f;
+    if (f) {
+        err = fwrite(&h, sizeof(h), 1, f) != 1 ||
+              fwrite(slots, sizeof(PathSlot), nslots, f) != nslots ||
+              fwrite(sp.buf, 1, sp.len, f) != sp.len ||
+              fflush(f) || fsync(fileno(f));
+        fclose(f);
+        if (!err) err = rename(tmp, path) != 0;
+        if (err) unlink(tmp);
+    }
+    free(slots); free(sp.buf);
+    if (err) { fprintf(stderr, "Failed to write %s\n", path); return -1; }
+    if (pidx.log) { fclose(pidx.log); pidx.log = NULL; }
+    truncate(logp, 0);
+    overlay_free();
+    return pathidx_map();
+}
+
+static int pathidx_log(const char *op, const char *a, const char *b) {
+    if (!pidx.log) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, PATHLOG_FILE);
+        pidx.log = fopen(path, "a");
+        if (!pidx.log) return -1;
+    }
+    return fprintf(pidx.log, b ? "%s%s\t%s\n" : "%s%s\n", op, a, b) < 0 ? -1 : 0;
+}
+
+static void set_owner(const char *path, const char *owner) {
+    overlay_put(path, owner);
+    pathidx_log("+", owner, path);
+}
+
+static int clear_owner(const char *path, const char *owner) {
+    const char *cur = owner_of(path);
+    if (!cur || (owner && strcmp(cur, owner))) return 0;
+    overlay_put(path, NULL);
+    pathidx_log("-", path, NULL);
+    return 1;
+}
+
+void pathidx_set(const char *path, const char *owner) {
+    pthread_mutex_lock(&pidx.lock);
+    set_owner(path, owner);
+    pthread_mutex_unlock(&pidx.lock);
+}
+
+/* 1 if owner held path and gave it up */
+int pathidx_clear(const char *path, const char *owner) {
+    pthread_mutex_lock(&pidx.lock);
+    int r = clear_owner(path, owner);
+    pthread_mutex_unlock(&pidx.lock);
+    return r;
+}
+
+/* Take path for owner unless another package holds it. Returns 1 if
+   newly taken, 0 if owner already had it, -1 (holder filled) if not. */
+int pathidx_take(const char *path, const char *owner, char *holder, size_t len) {
+    pthread_mutex_lock(&pidx.lock);
+    const char *cur = owner_of(path);
+    int r = 1;
+    if (cur && strcmp(cur, owner)) { snprintf(holder, len, "%s", cur); r = -1; }
+    else if (cur) r = 0;
+    else set_owner(path, owner);
+    pthread_mutex_unlock(&pidx.lock);
+    return r;
+}
+
+/* Flush the change log; rebuild the table once the overlay gets large. */
+int pathidx_sync(void) {
+    pthread_mutex_lock(&pidx.lock);
+    int r = 0;
+    uint64_t base = pidx.hdr ? pidx.hdr->count : 0;
+    if (!pidx.loaded) r = 0;
+    /* inside a transaction the commit syncs the log */
+    else if (pidx.log && (fflush(pidx.log) || (!txn.depth && fsync(fileno(pidx.log))))) r = -1;
+    else if (pidx.ovused > 4096 && pidx.ovused > base / 4) r = pathidx_rebuild();
+    pthread_mutex_unlock(&pidx.lock);
+    return r;
+}
+
+/* first use on an existing system: index every .files manifest */
+static int pathidx_import(void) {
+    DIR *d = opendir(PKG_DB_PATH);
+    if (!d) return -1;
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        char *suf = strstr(e->d_name, ".files");
+        if (!suf || suf[6]) continue;
+        char owner[256], path[512], line[MANIFEST_LINE];
+        snprintf(owner, sizeof(owner), "%.*s", (int)(suf - e->d_name), e->d_name);
+        snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, e->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        while (manifest_next(f, line, NULL)) if (!is_dir_entry(line)) overlay_put(line, owner);
+        fclose(f);
+    }
+    closedir(d);
+    return pathidx_rebuild();
+}
+
+int pathidx_open(void) {
+    pthread_mutex_lock(&pidx.lock);
+    int r = 0;
+    if (!pidx.loaded) {
+        r = pathidx_map();
+        if (r >= 0) {
+            pidx.loaded = 1;
+            if (r > 0) r = pathidx_import();
+            else pathidx_replay();
+        }
+    }
+    pthread_mutex_unlock(&pidx.lock);
+    return r < 0 ? -1 : 0;
+}
+
+/* another process changed the index; the next pathidx_open() reloads it */
+static void pathidx_forget(void) {
+    pthread_mutex_lock(&pidx.lock);
+    overlay_free();
+    pidx.loaded = 0;
+    pthread_mutex_unlock(&pidx.lock);
+}
+
+static void devset_add(DevSet *ds, const char *path) {
+    struct stat st;
+    if (ds->n == TXN_MAX_DEVS || stat(path, &st)) return;
+    for (int k = 0; k < ds->n; k++) if (ds->dev[k] == st.st_dev) return;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    ds->dev[ds->n] = st.st_dev;
+    ds->fd[ds->n++] = fd;
+}
+
+/* stat only when the directory changes: lists are mostly grouped */
+static void devset_files(DevSet *ds, const PathList *files) {
+    const char *last = NULL;
+    size_t lastlen = 0;
+    for (int i = 0; i < files->n; i++) {
+        const char *p = files->v[i], *slash = strrchr(p, '/');
+        size_t len = slash - p;
+        if (last && len == lastlen && !strncmp(p, last, len)) continue;
+        last = p; lastlen = len;
+        devset_add(ds, p);
+    }
+}
+
+/* one syncfs() per filesystem instead of an fsync per file */
+static int devset_sync(DevSet *ds) {
+    int err = 0;
+    for (int k = 0; k < ds->n; k++) {
+        err |= syncfs(ds->fd[k]);
+        close(ds->fd[k]);
+    }
+    ds->n = 0;
+    return err;
+}
+
+static void journal_write(const char *fmt, ...) {
+    if (!txn.depth || txn.fd < 0) return;
+    char line[4096];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (n >= (int)sizeof(line)) { n = sizeof(line) - 1; line[n-1] = '\n'; }
+    if (write(txn.fd, line, n) != n) fprintf(stderr, "Warning: journal write failed: %s\n", strerror(errno));
+}
+
+int txn_begin(const char *op) {
+    if (txn.depth) { txn.depth++; return 0; }
+    if (txn_lock(1)) {
+        fprintf(stderr, "Can't lock %s/%s: %s\n", PKG_DB_PATH, JOURNAL_LOCK, strerror(errno));
+        return -1;
+    }
+    /* one that died while we waited, or was running when db_init looked */
+    if (!txn.recovering && journal_recover()) { txn_unlock(); return -1; }
+    txn.depth = 1;
+    snprintf(txn.op, sizeof(txn.op), "%s", op);
+    if (!history_last()) history_record("base");
+    /* an image under --root is rebuilt rather than recovered: no journal,
+       and the whole tree is synced once at commit */
+    if (*PKG_ROOT) { devset_add(&txn.devs, PKG_ROOT); return 0; }
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, JOURNAL_FILE);
+    txn.fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+    if (txn.fd < 0) {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        if (!txn.recovering) txn_unlock();
+        txn.depth = 0;
+        return -1;
+    }
+    journal_write("B %s %ld\n", op, (long)time(NULL));
+    return 0;
+}
+
+/* Group commit: one sync of everything the transaction wrote, then the
+   commit record, then packages.db. If the sync or the record fails,
+   nothing is committed and the journal is left for journal_recover. */
+int txn_commit(void) {
+    if (!txn.depth || --txn.depth) return 0;
+    Span sp;
+    span_begin(&sp);
+    devset_add(&txn.devs, PKG_DB_PATH);
+    int err = pathidx_sync() | devset_sync(&txn.devs);
+    if (err) fprintf(stderr, "Sync failed: %s\n", strerror(errno));
+    else if (txn.fd >= 0 && (write(txn.fd, "C\n", 2) != 2 || fsync(txn.fd))) {
+        fprintf(stderr, "Can't write commit record: %s\n", strerror(errno));
+        err = 1;
+    }
+    int r = err ? -1 : pkgdb_commit();
+    if (txn.fd >= 0) {
+        if (!r && ftruncate(txn.fd, 0)) r = -1;
+        close(txn.fd);
+        txn.fd = -1;
+    }
+    if (!r) history_record(txn.op);
+    if (!txn.recovering) txn_unlock();
+    span_end(&sp, PH_COMMIT, "journal", 0, 0);
+    return r;
+}
+
+static void txn_files(const PathList *files) {
+    pthread_mutex_lock(&txn.lock);
+    devset_files(&txn.devs, files);
+    pthread_mutex_unlock(&txn.lock);
+}
+
+/* Undo or finish what an interrupted transaction left. With a commit
+   record everything is rolled forward. Without one, fresh installs are
+   rolled back; updates that finished unpacking are kept, since the old
+   files are gone anyway; removals are always finished. */
+static void drop_path(const char *package_name, const char *path);
+
+static int journal_recover(void) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, JOURNAL_FILE);
+    FILE *f = fopen(path, "r");
+    if (!f) return 0;
+    PathList lines = {0}, fwd = {0};
+    char line[4096];
+    int committed = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strchr(line, '\n')) break;     /* torn last line */
+        line[strcspn(line, "\n")] = 0;
+        if (!strcmp(line, "C")) committed = 1;
+        else if (strlen(line) > 2) path_list_add(&lines, line);
+    }
+    fclose(f);
+    if (!lines.n) { unlink(path); return 0; }
+    printf("Recovering interrupted transaction: %s\n", lines.v[0] + 2);
+    if (pathidx_open()) { path_list_free(&lines); return -1; }
+    txn.recovering = 1;
+    for (int i = 0; i < lines.n; i++) {
+        char *l = lines.v[i];
+        if (*l != 'I') continue;
+        Package p = {0};
+        char *cur = l + 2, *fld[8];
+        int k = 0;
+        while (cur && k < 8) fld[k++] = strsep(&cur, "\t");
+        if (k < 5) continue;
+        if (!committed && !is_installed(fld[0])) continue;
+        strncpy(p.name, fld[0], sizeof(p.name)-1);
+        strncpy(p.version, fld[1], sizeof(p.version)-1);
+        strncpy(p.arch, fld[2], sizeof(p.arch)-1);
+        p.size = strtoull(fld[3], NULL, 10);
+        p.install_time = atol(fld[4]);
+        if (k > 5) strncpy(p.depends, fld[5], sizeof(p.depends)-1);
+        if (k > 6) strncpy(p.description, fld[6], sizeof(p.description)-1);
+        if (k > 7) p.flags = strtoul(fld[7], NULL, 10) & DB_AUTO;
+        pkgdb_put(&p);
+        path_list_add(&fwd, p.name);
+        printf(" kept %s %s\n", p.name, p.version);
+    }
+    int undone = 0;
+    /* newest first, so files go before the directories holding them */
+    for (int i = lines.n - 1; !committed && i >= 0; i--) {
+        char *l = lines.v[i], *tab = strchr(l, '\t');
+        if ((*l != 'N' && *l != 'T') || !tab) continue;
+        *tab = 0;
+        const char *name = l + 2, *file = tab + 1;
+        int k;
+        for (k = 0; k < fwd.n && strcmp(fwd.v[k], name); k++);
+        if (k < fwd.n) continue;
+        char rp[1280];
+        const char *dp = root_path(file, rp, sizeof(rp));
+        if (is_dir_entry(file)) { if (dp) rmdir(dp); continue; }
+        if (*l == 'N' && dp && !unlink(dp)) undone++;
+        pathidx_clear(file, name);
+        if (!is_installed(name)) {
+            char files[512];
+            snprintf(files, sizeof(files), "%s/%s.files", PKG_DB_PATH, name);
+            unlink(files);
+        }
+    }
+    if (undone) printf(" removed %d files of unfinished installs\n", undone);
+    /* updates that are kept finish deleting what their new version dropped */
+    for (int i = 0; i < lines.n; i++) {
+        char *l = lines.v[i], *tab = strchr(l, '\t');
+        if (*l != 'D' || !tab) continue;
+        *tab = 0;
+        int k;
+        for (k = 0; k < fwd.n && strcmp(fwd.v[k], l + 2); k++);
+        if (k < fwd.n) drop_path(l + 2, tab + 1);
+    }
+    int err = pkgdb_commit() | pathidx_sync();
+    /* removals run as a fresh transaction appended to this one; its
+       commit retires the whole journal */
+    int removing = 0;
+    for (int i = 0; !err && i < lines.n; i++) {
+        if (lines.v[i][0] != 'X') continue;
+        if (!removing++ && txn_begin("recover")) { err = 1; break; }
+        remove_package(lines.v[i] + 2);
+    }
+    if (removing && !err) err = txn_commit();
+    txn.recovering = 0;
+    path_list_free(&lines); path_list_free(&fwd);
+    if (!err && !removing) unlink(path);
+    return err ? -1 : 0;
+}
+
+static void parse_pkginfo(char *buf, Package *pkg) {
+    char *save;
+    char *line = strtok_r(buf, "\n", &save);
+    while (line) {
+        if (!strncmp(line, "name=", 5)) strncpy(pkg->name, line+5, sizeof(pkg->name)-1);
+        else if (!strncmp(line, "version=", 8)) strncpy(pkg->version, line+8, sizeof(pkg->version)-1);
+        else if (!strncmp(line, "arch=", 5)) strncpy(pkg->arch, line+5, sizeof(pkg->arch)-1);
+        else if (!strncmp(line, "description=", 12)) strncpy(pkg->description, line+12, sizeof(pkg->description)-1);
+        else if (!strncmp(line, "depends=", 8)) strncpy(pkg->depends, line+8, sizeof(pkg->depends)-1);
+        else if (!strncmp(line, "size=", 5)) pkg->size = atol(line+5);
+        line = strtok_r(NULL, "\n", &save);
+    }
+}
+
+static Package* read_pkginfo_entry(struct archive *a, struct archive_entry *entry) {
+    Package *pkg = malloc(sizeof(Package));
+    memset(pkg, 0, sizeof(Package));
+    size_t sz = archive_entry_size(entry);
+    char *buf = malloc(sz + 1);
+    la_ssize_t got = archive_read_data(a, buf, sz);
+    buf[got > 0 ? got : 0] = '\0';
+    parse_pkginfo(buf, pkg);
+    free(buf);
+    return pkg;
+}
+
+static int is_pkginfo(const char *name) {
+    return !strcmp(name, "PKGINFO") || !strcmp(name, "./PKGINFO");
+}
+
+static int is_metadata(const char *name) {
+    return !strncmp(name, "PKGINFO", 7) || !strncmp(name, "FILES", 5) ||
+           !strncmp(name, "./PKGINFO", 9) || !strncmp(name, "./FILES", 7);
+}
+
+Package* read_package_info(const char *archive_path) {
+    Span sp;
+    span_begin(&sp);
+    struct archive *a = archive_read_new();
+    archive_read_support_format_all(a);
+    archive_read_support_filter_all(a);
+    if (archive_read_open_filename(a, archive_path, 10240)) {
+        archive_read_free(a);
+        return NULL;
+    }
+    struct archive_entry *entry;
+    Package *pkg = NULL;
+    while (archive_read_next_header(a, &entry) == ARCHIVE_OK) {
+        if (!is_pkginfo(archive_entry_pathname(entry))) { archive_read_data_skip(a); continue; }
+        pkg = read_pkginfo_entry(a, entry);
+        break;
+    }
+    archive_read_close(a);
+    archive_read_free(a);
+    span_end(&sp, PH_PKGINFO, archive_path, 0, 0);
+    return pkg;
+}
+
+/* next name from a "a, b, c" depends list; 0 when exhausted */
+static int dep_next(const char **cur, char *out, size_t len) {
+    const char *p = *cur;
+    while (*p == ',' || *p == ' ') p++;
+    if (!*p) { *cur = p; return 0; }
+    size_t n = strcspn(p, ",");
+    *cur = p + n;
+    while (n && p[n-1] == ' ') n--;
+    snprintf(out, len, "%.*s", (int)n, p);
+    return 1;
+}
+
+int check_dependencies(const char *depends) {
+    char dep[256];
+    int miss = 0;
+    while (dep_next(&depends, dep, sizeof(dep))) {
+        if (!is_installed(dep)) { printf("Error: dependency '%s' is missing!\n", dep); miss++; }
+        else printf("Dependency '%s' is installed.\n", dep);
+    }
+    if (miss) { fprintf(stderr, "%d dependencies are missing.\n", miss); return -1; }
+    return 0;
+}
+
+/* archive suffix from repo.db's format=, tar.xz when it has none */
+static const char* package_format(const RepoEntry *r) {
+    return r && r->format ? RS(r->format) : "tar.xz";
+}
+
+/* Where a package's archive lives in the cache: blobs/<sha256> when
+   repo.db lists a checksum, so versions never overwrite each other,
+   else the old name-keyed <name>.<format>. */
+static const RepoEntry* cache_path(const char *package_name, char *out, size_t len) {
+    const RepoEntry *r = repo_open() ? NULL : repo_find(package_name);
+    if (r && r->sha256) snprintf(out, len, "%s/blobs/%s", PKG_CACHE_PATH, RS(r->sha256));
+    else snprintf(out, len, "%s/%s.%s", PKG_CACHE_PATH, package_name, package_format(r));
+    return r;
+}
+
+static void package_download(Download *d, const char *package_name) {
+    memset(d, 0, sizeof(*d));
+    strncpy(d->label, package_name, sizeof(d->label)-1);
+    const RepoEntry *r = cache_path(package_name, d->out, sizeof(d->out));
+    snprintf(d->path, sizeof(d->path), "%s.%s", package_name, package_format(r));
+    if (!r || !r->sha256) return;
+    strncpy(d->sha256, RS(r->sha256), sizeof(d->sha256)-1);
+    d->csize = r->csize;
+    /* blobs only appear under their name once verified */
+    struct stat st;
+    d->cached = !stat(d->out, &st) && (!d->csize || (uint64_t)st.st_size == d->csize);
+}
+
+#define STREAM_BUF (4 << 20)
+
+static Stream* stream_new(size_t cap, size_t chunk) {
+    Stream *s = calloc(1, sizeof(Stream));
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    s->cap = cap;
+    s->buf = malloc(s->cap);
+    s->chunk = chunk;
+    s->out = malloc(chunk);
+    return s;
+}
+
+static void stream_free(Stream *s) {
+    if (!s) return;
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->cond);
+    free(s->buf); free(s->out); free(s);
+}
+
+static void stream_finish(Stream *s, int failed) {
+    pthread_mutex_lock(&s->lock);
+    s->done = 1;
+    s->failed = failed;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* Append n bytes. Returns n, 0 if the reader cancelled, or
+   CURL_WRITEFUNC_PAUSE when full and the writer is able to pause. */
+static size_t stream_put(Stream *s, const char *ptr, size_t n) {
+    pthread_mutex_lock(&s->lock);
+    while (s->nopause && s->len && n > s->cap - s->len && !s->cancel)
+        pthread_cond_wait(&s->cond, &s->lock);
+    if (s->cancel) { pthread_mutex_unlock(&s->lock); return 0; }
+    if (n > s->cap - s->len) {
+        if (s->len) { s->paused = 1; pthread_mutex_unlock(&s->lock); return CURL_WRITEFUNC_PAUSE; }
+        /* a single chunk bigger than the whole buffer */
+        free(s->buf);
+        s->buf = malloc(n);
+        s->cap = n;
+        s->head = 0;
+    }
+    size_t tail = (s->head + s->len) % s->cap;
+    size_t first = n < s->cap - tail ? n : s->cap - tail;
+    memcpy(s->buf + tail, ptr, first);
+    memcpy(s->buf, ptr + first, n - first);
+    s->len += n;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+/* Take up to max bytes, waiting for data. 0 at the end, -1 if the
+   writer failed. */
+static ssize_t stream_pull(Stream *s, void *buf, size_t max) {
+    pthread_mutex_lock(&s->lock);
+    while (!s->len && !s->done) pthread_cond_wait(&s->cond, &s->lock);
+    size_t n = s->len;
+    if (n > s->cap - s->head) n = s->cap - s->head;
+    if (n > max) n = max;
+    memcpy(buf, s->buf + s->head, n);
+    s->head = (s->head + n) % s->cap;
+    s->len -= n;
+    pthread_cond_broadcast(&s->cond);
+    int wake = s->paused, failed = s->failed;
+    pthread_mutex_unlock(&s->lock);
+    if (wake && s->multi) curl_multi_wakeup(s->multi);
+    return !n && failed ? -1 : (ssize_t)n;
+}
+
+/* wait for the first n bytes without consuming them */
+static size_t stream_peek(Stream *s, void *buf, size_t n) {
+    pthread_mutex_lock(&s->lock);
+    while (s->len < n && !s->done) pthread_cond_wait(&s->cond, &s->lock);
+    if (n > s->len) n = s->len;
+    for (size_t i = 0; i < n; i++) ((char *)buf)[i] = s->buf[(s->head + i) % s->cap];
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+static void download_hash(Download *d, const char *ptr, size_t n) {
+    if (d->md) EVP_DigestUpdate(d->md, ptr, n);
+    d->got += n;
+}
+
+static size_t file_write(char *ptr, size_t size, size_t nmemb, void *data) {
+    Segment *s = data;
+    size_t n = fwrite(ptr, size, nmemb, s->d->fp) * size;
+    download_hash(s->d, ptr, n);
+    s->got += n;
+    return n;
+}
+
+static size_t stream_write(char *ptr, size_t size, size_t nmemb, void *data) {
+    Segment *s = data;
+    Download *d = s->d;
+    size_t n = stream_put(d->stream, ptr, size * nmemb);
+    if (n != size * nmemb) return n;
+    if (d->fp && fwrite(ptr, 1, n, d->fp) != n) return 0;
+    download_hash(d, ptr, n);
+    s->got += n;
+    return n;
+}
+
+/* libarchive read callback: hand over whatever the writer has buffered */
+static la_ssize_t stream_read(struct archive *a, void *data, const void **out) {
+    Stream *s = data;
+    ssize_t n = stream_pull(s, s->out, s->chunk);
+    if (n < 0) { archive_set_error(a, EIO, "download failed"); return -1; }
+    *out = s->out;
+    return n;
+}
+
+/* read and discard the rest of a transfer; nonzero if it failed,
+   which includes a checksum mismatch */
+static int stream_drain(Stream *s) {
+    pthread_mutex_lock(&s->lock);
+    while (!s->done) {
+        s->head = s->len = 0;
+        pthread_cond_broadcast(&s->cond);
+        if (s->paused) {
+            pthread_mutex_unlock(&s->lock);
+            if (s->multi) curl_multi_wakeup(s->multi);
+            pthread_mutex_lock(&s->lock);
+        }
+        if (!s->done) pthread_cond_wait(&s->cond, &s->lock);
+    }
+    int failed = s->failed;
+    pthread_mutex_unlock(&s->lock);
+    return failed;
+}
+
+/* stop the transfer feeding s, e.g. when unpacking hit a conflict */
+static void stream_cancel(Stream *s) {
+    pthread_mutex_lock(&s->lock);
+    s->cancel = 1;
+    pthread_cond_broadcast(&s->cond);
+    int wake = s->paused;
+    pthread_mutex_unlock(&s->lock);
+    if (wake && s->multi) curl_multi_wakeup(s->multi);
+}
+
+/* Mirrors: PKG_REPO_URL lists one or more, separated by spaces. They
+   are ranked by the expected time to fetch 1 MiB, latency plus size
+   over throughput, measured on every transfer and by the probe in
+   `mpkg update`, and kept in PKG_CACHE_PATH/mirrors between runs.
+   Consecutive failures push a mirror down the ranking; one that can't
+   be reached or stalls is skipped for the rest of the run. */
+#define MIRROR_FILE "mirrors"
+
+typedef struct {
+    char url[512];
+    double latency;     /* seconds to the first byte, 0 if unknown */
+    double rate;        /* bytes per second, 0 if unknown */
+    int fails;          /* consecutive failures */
+    int ranges;         /* serves byte ranges: 1, 0, or -1 unknown */
+    int down;           /* unreachable in this run */
+} Mirror;
+
+static struct {
+    Mirror m[MIRROR_MAX];
+    int n, loaded, dirty;
+    pthread_mutex_t lock;
+} mirrors = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void mirror_load(void) {
+    if (mirrors.loaded) return;
+    mirrors.loaded = 1;
+    char list[sizeof(PKG_REPO_URL)], *save;
+    snprintf(list, sizeof(list), "%s", PKG_REPO_URL);
+    for (char *u = strtok_r(list, " \t", &save); u && mirrors.n < MIRROR_MAX; u = strtok_r(NULL, " \t", &save)) {
+        Mirror *mi = &mirrors.m[mirrors.n++];
+        size_t n = snprintf(mi->url, sizeof(mi->url), "%s", u);
+        while (n > 0 && mi->url[n-1] == '/') mi->url[--n] = 0;
+        mi->ranges = strncmp(u, "file:", 5) ? -1 : 1;
+    }
+    char path[512], line[1024], url[512];
+    snprintf(path, sizeof(path), "%s/%s", PKG_CACHE_PATH, MIRROR_FILE);
+    FILE *f = fopen(path, "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        Mirror c;
+        if (sscanf(line, "%511s %lf %lf %d %d", url, &c.latency, &c.rate, &c.fails, &c.ranges) != 5) continue;
+        for (int i = 0; i < mirrors.n; i++) {
+            Mirror *mi = &mirrors.m[i];
+            if (strcmp(mi->url, url)) continue;
+            mi->latency = c.latency; mi->rate = c.rate; mi->fails = c.fails;
+            if (mi->ranges < 0) mi->ranges = c.ranges;
+        }
+    }
+    if (f) fclose(f);
+}
+
+static void mirror_save(void) {
+    pthread_mutex_lock(&mirrors.lock);
+    char path[512], tmp[600];
+    snprintf(path, sizeof(path), "%s/%s", PKG_CACHE_PATH, MIRROR_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+    FILE *f = mirrors.dirty ? fopen(tmp, "w") : NULL;
+    if (f) {
+        for (int i = 0; i < mirrors.n; i++) {
+            const Mirror *mi = &mirrors.m[i];
+            fprintf(f, "%s %.6f %.0f %d %d\n", mi->url, mi->latency, mi->rate, mi->fails, mi->ranges);
+        }
+        if (fclose(f) || rename(tmp, path)) unlink(tmp);
+        else mirrors.dirty = 0;
+    }
+    pthread_mutex_unlock(&mirrors.lock);
+}
+
+/* expected seconds for 1 MiB; unmeasured mirrors get middling guesses */
+static double mirror_score(const Mirror *mi) {
+    double t = (mi->latency > 0 ? mi->latency : 0.1) + (1 << 20) / (mi->rate > 0 ? mi->rate : 1e6);
+    return t * (1 + mi->fails);
+}
+
+/* Best mirror for s that it hasn't failed on, weighed by how many
+   segments of the same download each one is already serving. */
+static int mirror_pick(const Download *d, const Segment *s) {
+    int best = -1;
+    double bs = 0;
+    pthread_mutex_lock(&mirrors.lock);
+    for (int i = 0; i < mirrors.n; i++) {
+        const Mirror *mi = &mirrors.m[i];
+        if (mi->down || (s->tried >> i & 1) || (s->len && !mi->ranges)) continue;
+        double sc = mirror_score(mi) * (1 + d->busy[i]);
+        if (best < 0 || sc < bs) { best = i; bs = sc; }
+    }
+    pthread_mutex_unlock(&mirrors.lock);
+    return best;
+}
+
+static int mirror_ranges(void) {
+    for (int i = 0; i < mirrors.n; i++) if (mirrors.m[i].ranges && !mirrors.m[i].down) return 1;
+    return 0;
+}
+
+/* fold a finished transfer into its mirror's numbers */
+static void mirror_note(const Segment *s, CURLcode res) {
+    pthread_mutex_lock(&mirrors.lock);
+    Mirror *mi = &mirrors.m[s->mirror];
+    mirrors.dirty = 1;
+    if (res != CURLE_OK) {
+        mi->fails++;
+        if (res == CURLE_COULDNT_CONNECT || res == CURLE_COULDNT_RESOLVE_HOST || res == CURLE_OPERATION_TIMEDOUT)
+            mi->down = 1;
+    } else {
+        double start = 0, total = 0;
+        curl_off_t bytes = 0;
+        curl_easy_getinfo(s->curl, CURLINFO_STARTTRANSFER_TIME, &start);
+        curl_easy_getinfo(s->curl, CURLINFO_TOTAL_TIME, &total);
+        curl_easy_getinfo(s->curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+        mi->fails = 0;
+        if (s->len) mi->ranges = 1;
+        mi->latency = mi->latency > 0 ? 0.7 * mi->latency + 0.3 * start : start;
+        /* small files say more about latency than throughput */
+        if (bytes >= 256 << 10 && total > start) {
+            double r = bytes / (total - start);
+            mi->rate = mi->rate > 0 ? 0.7 * mi->rate + 0.3 * r : r;
+        }
+    }
+    pthread_mutex_unlock(&mirrors.lock);
+}
+
+static size_t discard(char *ptr, size_t size, size_t nmemb, void *data) {
+    return size * nmemb;
+}
+
+/* Time one byte of repo.db from every mirror at once, which also shows
+   which of them serve ranges. */
+static void mirror_probe(int show) {
+    CURLM *m = curl_multi_init();
+    CURL *c[MIRROR_MAX];
+    for (int i = 0; i < mirrors.n; i++) {
+        char url[600];
+        snprintf(url, sizeof(url), "%s/repo.db", mirrors.m[i].url);
+        c[i] = curl_easy_init();
+        curl_easy_setopt(c[i], CURLOPT_URL, url);
+        curl_easy_setopt(c[i], CURLOPT_RANGE, "0-0");
+        curl_easy_setopt(c[i], CURLOPT_WRITEFUNCTION, discard);
+        curl_easy_setopt(c[i], CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(c[i], CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(c[i], CURLOPT_CONNECTTIMEOUT, 5L);
+        curl_easy_setopt(c[i], CURLOPT_TIMEOUT, 10L);
+        curl_easy_setopt(c[i], CURLOPT_PRIVATE, &mirrors.m[i]);
+        curl_multi_add_handle(m, c[i]);
+    }
+    int running;
+    do {
+        curl_multi_perform(m, &running);
+        if (running) curl_multi_poll(m, NULL, 0, 1000, NULL);
+    } while (running);
+    CURLMsg *msg;
+    int left;
+    while ((msg = curl_multi_info_read(m, &left))) {
+        if (msg->msg != CURLMSG_DONE) continue;
+        Mirror *mi;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&mi);
+        if (msg->data.result != CURLE_OK) { mi->fails++; mi->down = 1; continue; }
+        long code = 0;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_STARTTRANSFER_TIME, &mi->latency);
+        mi->fails = mi->down = 0;
+        mi->ranges = code == 206 || !strncmp(mi->url, "file:", 5);
+    }
+    for (int i = 0; i < mirrors.n; i++) { curl_multi_remove_handle(m, c[i]); curl_easy_cleanup(c[i]); }
+    curl_multi_cleanup(m);
+    mirrors.dirty = 1;
+    if (!show) return;
+    int order[MIRROR_MAX];
+    for (int i = 0; i < mirrors.n; i++) order[i] = i;
+    for (int i = 1; i < mirrors.n; i++)
+        for (int j = i; j > 0 && mirror_score(&mirrors.m[order[j]]) < mirror_score(&mirrors.m[order[j-1]]); j--) {
+            int t = order[j]; order[j] = order[j-1]; order[j-1] = t;
+        }
+    printf("Mirrors, best first:\n");
+    for (int i = 0; i < mirrors.n; i++) {
+        const Mirror *mi = &mirrors.m[order[i]];
+        if (mi->down) { printf(" %s  failing\n", mi->url); continue; }
+        printf(" %s  %.0f ms", mi->url, mi->latency * 1000);
+        if (mi->rate > 0) printf(", %.1f MB/s", mi->rate / 1e6);
+        printf("%s\n", mi->ranges ? "" : ", no ranges");
+    }
+}
+
+/* ranges land at their offset; a server that ignores Range and sends
+   the whole file is caught on the first block */
+static size_t range_write(char *ptr, size_t size, size_t nmemb, void *data) {
+    Segment *s = data;
+    size_t n = size * nmemb;
+    long code = 0;
+    curl_easy_getinfo(s->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code == 200) {
+        pthread_mutex_lock(&mirrors.lock);
+        mirrors.m[s->mirror].ranges = 0;
+        pthread_mutex_unlock(&mirrors.lock);
+        return 0;
+    }
+    if (s->got + n > s->len || pwrite(fileno(s->d->fp), ptr, n, s->off + s->got) != (ssize_t)n) return 0;
+    s->got += n;
+    s->d->got += n;
+    return n;
+}
+
+/* Put s on the best mirror left for it, resuming where the last one
+   stopped. */
+static int segment_start(CURLM *m, Segment *s) {
+    Download *d = s->d;
+    int i = mirror_pick(d, s);
+    CURL *c = i >= 0 ? curl_easy_init() : NULL;
+    if (!c) return -1;
+    char url[1100];
+    snprintf(url, sizeof(url), "%s/%s", mirrors.m[i].url, d->path);
+    curl_easy_setopt(c, CURLOPT_URL, url);
+    if (d->stream) {
+        d->stream->multi = m;
+        d->stream->nopause = !strncmp(url, "file:", 5);
+        curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, stream_write);
+    } else curl_easy_setopt(c, CURLOPT_WRITEFUNCTION, s->len ? range_write : file_write);
+    curl_easy_setopt(c, CURLOPT_WRITEDATA, s);
+    if (s->len) {
+        char range[64];
+        snprintf(range, sizeof(range), "%llu-%llu", (unsigned long long)(s->off + s->got),
+                 (unsigned long long)(s->off + s->len - 1));
+        curl_easy_setopt(c, CURLOPT_RANGE, range);
+    }
+    else if (s->got) curl_easy_setopt(c, CURLOPT_RESUME_FROM_LARGE, (curl_off_t)s->got);
+    curl_easy_setopt(c, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(c, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(c, CURLOPT_PRIVATE, s);
+    if (mirrors.n > 1) {
+        /* with somewhere else to go, don't wait on a dead or stalled mirror */
+        curl_easy_setopt(c, CURLOPT_CONNECTTIMEOUT, 10L);
+        curl_easy_setopt(c, CURLOPT_LOW_SPEED_LIMIT, 1024L);
+        curl_easy_setopt(c, CURLOPT_LOW_SPEED_TIME, 15L);
+    }
+    s->mirror = i;
+    s->base = s->got;
+    s->curl = c;
+    s->state = 1;
+    d->busy[i]++;
+    d->running++;
+    curl_multi_add_handle(m, c);
+    return 0;
+}
+
+static void segment_stop(CURLM *m, Segment *s) {
+    curl_multi_remove_handle(m, s->curl);
+    curl_easy_cleanup(s->curl);
+    s->curl = NULL;
+    s->state = 0;
+    s->d->busy[s->mirror]--;
+    s->d->running--;
+}
+
+/* Archives with a known size of at least two segments are fetched as
+   ranges, SEGMENT_CONNS at a time, each from the mirror that looks
+   fastest given what that mirror is already serving, so faster mirrors
+   end up with more of the file. Those are hashed once complete; a
+   single transfer is hashed as it arrives. */
+static int download_begin(CURLM *m, Download *d) {
+    char part[600];
+    snprintf(part, sizeof(part), "%s.part", d->out);
+    int keep = !d->stream || PKG_KEEP_CACHE, nseg = 1;
+    if (!d->stream && !d->base[0] && d->csize >= 2 * SEGMENT_SIZE && mirror_ranges()) {
+        nseg = (d->csize + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+        if (nseg > SEGMENT_MAX) nseg = SEGMENT_MAX;
+    }
+    d->fp = keep ? fopen(part, "w") : NULL;
+    int ok = !keep || d->fp;
+    if (ok && d->sha256[0] && !d->base[0] && nseg == 1) {
+        d->md = EVP_MD_CTX_new();
+        if (d->md && !EVP_DigestInit_ex(d->md, EVP_sha256(), NULL)) { EVP_MD_CTX_free(d->md); d->md = NULL; }
+        ok = d->md != NULL;
+    }
+    d->seg = ok ? calloc(nseg, sizeof(Segment)) : NULL;
+    if (d->seg) {
+        uint64_t size = (d->csize + nseg - 1) / nseg;
+        d->nseg = nseg;
+        d->running = d->failed = 0;
+        memset(d->busy, 0, sizeof(d->busy));
+        for (int k = 0; k < nseg; k++) {
+            d->seg[k].d = d;
+            d->seg[k].off = k * size;
+            d->seg[k].len = nseg == 1 ? 0 : k == nseg - 1 ? d->csize - k * size : size;
+        }
+    }
+    if (!d->seg || segment_start(m, &d->seg[0])) {
+        if (d->fp) { fclose(d->fp); unlink(part); }
+        d->fp = NULL;
+        EVP_MD_CTX_free(d->md);
+        d->md = NULL;
+        free(d->seg);
+        d->seg = NULL;
+        fprintf(stderr, "Can't start download of %s\n", d->label);
+        if (d->stream) stream_finish(d->stream, 1);
+        return -1;
+    }
+    for (int k = 1; k < nseg && k < SEGMENT_CONNS; k++) segment_start(m, &d->seg[k]);
+    if (timing.on) d->t0 = clock_sec(CLOCK_MONOTONIC);
+    if (nseg > 1) printf("Grabbing %s in %d ranges\n", d->label, nseg);
+    else printf("Grabbing %s\n", d->label);
+    return 0;
+}
+
+/* check what came in against the size and sha256 from repo.db */
+static int download_verify(Download *d, const char *hex) {
+    if (d->csize && d->got != d->csize) {
+        fprintf(stderr, "%s: expected %llu bytes, got %llu\n", d->label,
+                (unsigned long long)d->csize, (unsigned long long)d->got);
+        return -1;
+    }
+    if (hex && strcmp(hex, d->sha256)) {
+        fprintf(stderr, "%s: checksum mismatch\n expected %s\n got      %s\n", d->label, d->sha256, hex);
+        return -1;
+    }
+    return 0;
+}
+
+static int sha256_file(const char *path, char *hex);
+
+static int download_check(Download *d) {
+    char hex[2 * EVP_MAX_MD_SIZE + 1], part[600];
+    if (d->nseg > 1) {
+        if (!d->sha256[0]) return download_verify(d, NULL);
+        snprintf(part, sizeof(part), "%s.part", d->out);
+        if (fflush(d->fp) || sha256_file(part, hex)) return -1;
+        return download_verify(d, hex);
+    }
+    if (!d->md) return 0;
+    digest_hex(d->md, hex);
+    return download_verify(d, hex);
+}
+
+static int download_end(Download *d) {
+    char part[600];
+    snprintf(part, sizeof(part), "%s.part", d->out);
+    int bad = d->failed != 0, quiet = d->failed == 2 || (d->stream && d->stream->cancel);
+    EVP_MD_CTX_free(d->md);
+    d->md = NULL;
+    if (d->fp) {
+        bad |= fclose(d->fp) != 0;
+        d->fp = NULL;
+        if (!bad) bad = rename(part, d->out) != 0;
+        if (bad) unlink(part);
+    }
+    if (bad && !quiet)
+        fprintf(stderr, "Download of %s failed: %s\n", d->label, curl_easy_strerror(d->res));
+    /* transfers share the download thread, so none has a CPU time of its own */
+    if (timing.on) timing_add(PH_DOWNLOAD, d->label, d->t0, clock_sec(CLOCK_MONOTONIC) - d->t0, 0, d->got, 1);
+    if (d->stream) stream_finish(d->stream, bad);
+    free(d->seg);
+    d->seg = NULL;
+    return bad ? -1 : 2;
+}
+
+/* Start d over as one plain transfer, skipping the mirrors in tried. */
+static int download_restart(CURLM *m, Download *d, uint32_t tried) {
+    for (int k = 0; k < d->nseg; k++) if (d->seg[k].state == 1) segment_stop(m, &d->seg[k]);
+    Segment *s = &d->seg[0];
+    memset(s, 0, sizeof(*s));
+    s->d = d;
+    s->tried = tried;
+    d->nseg = 1;
+    d->got = 0;
+    if (!d->md && d->sha256[0]) d->md = EVP_MD_CTX_new();
+    if (d->stream || !d->fp || (d->sha256[0] && !d->md)) return -1;
+    rewind(d->fp);
+    if (ftruncate(fileno(d->fp), 0) || (d->md && !EVP_DigestInit_ex(d->md, EVP_sha256(), NULL))) return -1;
+    return segment_start(m, s);
+}
+
+/* A transfer finished. A failed one goes back in the queue and resumes
+   where it stopped: on the same mirror if that one made progress, else
+   on another. Ranges that no mirror will serve, and a file that fails
+   its checksum, start over as one transfer. Returns 1 while the
+   download is still going, else its final state. */
+static int segment_end(CURLM *m, Segment *s, CURLcode res) {
+    Download *d = s->d;
+    int ok = res == CURLE_OK && (!s->len || s->got == s->len);
+    mirror_note(s, ok ? CURLE_OK : res ? res : CURLE_PARTIAL_FILE);
+    int from = s->mirror;
+    segment_stop(m, s);
+    if (ok) s->state = 2;
+    else if (d->stream && d->stream->cancel) d->failed = 2;
+    else {
+        if (s->got == s->base || res == CURLE_HTTP_RETURNED_ERROR) s->tried |= 1u << from;
+        d->res = res;
+        if (mirror_pick(d, s) >= 0)
+            fprintf(stderr, "%s: %s failed (%s), resuming\n", d->label, mirrors.m[from].url, curl_easy_strerror(res));
+        else if (d->nseg > 1 && !download_restart(m, d, 0)) return 1;
+        else d->failed = 1;
+    }
+    for (int k = 0; k < d->nseg && !d->failed && d->running < SEGMENT_CONNS; k++)
+        if (!d->seg[k].state && segment_start(m, &d->seg[k])) d->failed = 1;
+    if (d->failed) {
+        for (int k = 0; k < d->nseg; k++) if (d->seg[k].state == 1) segment_stop(m, &d->seg[k]);
+        return download_end(d);
+    }
+    if (d->running) return 1;
+    if (download_check(d)) {
+        /* Some mirror has a bad copy. Only a single transfer tells which,
+           so ranges fall back to one, then each other mirror in turn. */
+        uint32_t tried = d->nseg > 1 ? 0 : s->tried | 1u << from;
+        if (!download_restart(m, d, tried)) {
+            fprintf(stderr, "%s: trying another mirror\n", d->label);
+            return 1;
+        }
+        d->failed = 2;
+    }
+    return download_end(d);
+}
+
+static void* download_thread(void *arg) {
+    DownloadBatch *b = arg;
+    CURLM *m = curl_multi_init();
+    curl_multi_setopt(m, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long)PKG_PARALLEL_DOWNLOADS * SEGMENT_CONNS);
+    int next = 0, active = 0;
+    for (;;) {
+        while (active < PKG_PARALLEL_DOWNLOADS && next < b->n) {
+            Download *d = &b->items[next++];
+            if (d->cached) printf("%s is cached\n", d->label);
+            if (d->cached || download_begin(m, d)) {
+                pthread_mutex_lock(&b->lock);
+                d->state = d->cached ? 2 : -1;
+                pthread_cond_broadcast(&b->done);
+                pthread_mutex_unlock(&b->lock);
+                continue;
+            }
+            d->state = 1;
+            active++;
+        }
+        if (!active) break;
+        int running;
+        curl_multi_perform(m, &running);
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(m, &left))) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            Segment *s;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&s);
+            Download *d = s->d;
+            int st = segment_end(m, s, msg->data.result);
+            if (st == 1) continue;
+            active--;
+            pthread_mutex_lock(&b->lock);
+            d->state = st;
+            pthread_cond_broadcast(&b->done);
+            pthread_mutex_unlock(&b->lock);
+        }
+        if (running) curl_multi_poll(m, NULL, 0, 1000, NULL);
+        /* resume streams whose reader has made room (or given up) */
+        for (int i = 0; i < next; i++) {
+            Stream *st = b->items[i].stream;
+            if (!st || b->items[i].state != 1 || !b->items[i].seg[0].curl) continue;
+            pthread_mutex_lock(&st->lock);
+            int resume = st->paused && (st->cancel || st->cap - st->len >= st->cap / 2);
+            if (resume) st->paused = 0;
+            pthread_mutex_unlock(&st->lock);
+            if (resume) curl_easy_pause(b->items[i].seg[0].curl, CURLPAUSE_CONT);
+        }
+    }
+    curl_multi_cleanup(m);
+    return NULL;
+}
+
+int download_start(DownloadBatch *b) {
+    if (!mirrors.loaded) {
+        mirror_load();
+        int unknown = 0;
+        for (int i = 0; i < mirrors.n; i++) unknown |= !mirrors.m[i].latency && !mirrors.m[i].fails;
+        if (mirrors.n > 1 && unknown) mirror_probe(0);
+    }
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->done, NULL);
+    for (int i = 0; i < b->n; i++) b->items[i].state = 0;
+    return pthread_create(&b->thread, NULL, download_thread, b) ? -1 : 0;
+}
+
+/* block until item i has finished; 0 when it landed in its output path */
+int download_wait(DownloadBatch *b, int i) {
+    pthread_mutex_lock(&b->lock);
+    while (b->items[i].state == 0 || b->items[i].state == 1)
+        pthread_cond_wait(&b->done, &b->lock);
+    int st = b->items[i].state;
+    pthread_mutex_unlock(&b->lock);
+    return st == 2 ? 0 : -1;
+}
+
+void download_finish(DownloadBatch *b) {
+    pthread_join(b->thread, NULL);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->done);
+    mirror_save();
+}
+
+static int download_one(Download *d) {
+    DownloadBatch b = { d, 1 };
+    if (download_start(&b)) return -1;
+    int r = download_wait(&b, 0);
+    download_finish(&b);
+    return r;
+}
+
+int download_package(const char *package_name) {
+    Download d;
+    package_download(&d, package_name);
+    return download_one(&d);
+}
+
+/* Fetch a delta instead when the repo publishes one against an archive
+   we still have. Returns 1 if d was switched over. */
+static int package_delta(Download *d, const char *package_name) {
+    const RepoEntry *r = repo_find(package_name);
+    if (!r || !r->sha256) return 0;
+    for (uint32_t k = 0; k < r->ndeltas; k++) {
+        const RepoDelta *x = &repo.delta[r->deltas + k];
+        char base[512];
+        snprintf(base, sizeof(base), "%s/blobs/%s", PKG_CACHE_PATH, RS(x->from));
+        if (access(base, R_OK)) continue;
+        if (r->csize && x->size >= r->csize) continue;
+        strcpy(d->base, base);
+        snprintf(d->label, sizeof(d->label), "%s (delta)", package_name);
+        snprintf(d->path, sizeof(d->path), "%s", RS(x->file));
+        strncat(d->out, ".delta", sizeof(d->out) - strlen(d->out) - 1);
+        return 1;
+    }
+    return 0;
+}
+
+/* Rebuild the new archive from d->base plus the fetched delta, hashing
+   it on the way to the cache. The delta is removed either way. */
+static int delta_apply(Download *d) {
+    char out[512], part[600];
+    snprintf(out, sizeof(out), "%.*s", (int)(strlen(d->out) - 6), d->out);
+    snprintf(part, sizeof(part), "%s.part", out);
+    Span sp;
+    span_begin(&sp);
+    int bfd = open(d->base, O_RDONLY), dfd = open(d->out, O_RDONLY);
+    struct stat bst, dst;
+    void *bm = MAP_FAILED, *dm = MAP_FAILED;
+    if (bfd >= 0 && !fstat(bfd, &bst) && bst.st_size)
+        bm = mmap(NULL, bst.st_size, PROT_READ, MAP_PRIVATE, bfd, 0);
+    if (dfd >= 0 && !fstat(dfd, &dst) && dst.st_size)
+        dm = mmap(NULL, dst.st_size, PROT_READ, MAP_PRIVATE, dfd, 0);
+    if (bfd >= 0) close(bfd);
+    if (dfd >= 0) close(dfd);
+    unlink(d->out);
+    ZSTD_DCtx *z = ZSTD_createDCtx();
+    FILE *f = fopen(part, "w");
+    d->md = EVP_MD_CTX_new();
+    d->got = 0;
+    int err = bm == MAP_FAILED || dm == MAP_FAILED || !z || !f || !d->md ||
+              !EVP_DigestInit_ex(d->md, EVP_sha256(), NULL);
+    if (!err) {
+        /* --patch-from windows cover the whole base archive */
+        ZSTD_DCtx_setParameter(z, ZSTD_d_windowLogMax, sizeof(size_t) == 4 ? 30 : 31);
+        err = ZSTD_isError(ZSTD_DCtx_refPrefix(z, bm, bst.st_size));
+    }
+    size_t cap = ZSTD_DStreamOutSize(), ret = 1;
+    char *buf = malloc(cap);
+    ZSTD_inBuffer in = { dm, err ? 0 : dst.st_size, 0 };
+    while (!err) {
+        ZSTD_outBuffer o = { buf, cap, 0 };
+        ret = ZSTD_decompressStream(z, &o, &in);
+        if (ZSTD_isError(ret)) { fprintf(stderr, "%s: %s\n", d->label, ZSTD_getErrorName(ret)); err = 1; break; }
+        if (fwrite(buf, 1, o.pos, f) != o.pos) err = 1;
+        download_hash(d, buf, o.pos);
+        if (in.pos == in.size && o.pos < cap) break;
+    }
+    if (!err && ret) { fprintf(stderr, "%s: truncated delta\n", d->label); err = 1; }
+    if (!err) {
+        char hex[2 * EVP_MAX_MD_SIZE + 1];
+        digest_hex(d->md, hex);
+        err = download_verify(d, hex) != 0;
+    }
+    if (f) err |= fclose(f) != 0;
+    if (!err) err = rename(part, out) != 0;
+    if (err) unlink(part);
+    free(buf);
+    ZSTD_freeDCtx(z);
+    EVP_MD_CTX_free(d->md);
+    d->md = NULL;
+    if (bm != MAP_FAILED) munmap(bm, bst.st_size);
+    if (dm != MAP_FAILED) munmap(dm, dst.st_size);
+    if (!err) printf("Rebuilt %s from a %lld byte delta\n", d->label, (long long)dst.st_size);
+    span_end(&sp, PH_DELTA, d->label, d->got, 1);
+    return err ? -1 : 0;
+}
+
+/* copy one entry's data, hashing it into md (if set) as it goes by */
+static int copy_data(struct archive *ar, struct archive *aw, EVP_MD_CTX *md, uint64_t *len) {
+    static const char zero[4096];
+    const void *buf; size_t sz; la_int64_t off;
+    uint64_t pos = 0;
+    for (;;) {
+        int r = archive_read_data_block(ar, &buf, &sz, &off);
+        if (r == ARCHIVE_EOF) break;
+        if (r < ARCHIVE_OK) return r;
+        r = archive_write_data_block(aw, buf, sz, off);
+        if (r < ARCHIVE_OK) return r;
+        /* sparse entries: the holes read back as zeros */
+        while (md && pos < (uint64_t)off) {
+            size_t n = off - pos < sizeof(zero) ? off - pos : sizeof(zero);
+            EVP_DigestUpdate(md, zero, n);
+            pos += n;
+        }
+        if (md) EVP_DigestUpdate(md, buf, sz);
+        pos = off + sz;
+    }
+    if (len) *len = pos;
+    return ARCHIVE_OK;
+}
+
+/* objects/: the file store for PKG_FILE_STORE=1. Regular files are
+   written here once, named by sha256, mode and owner, and deployed to
+   their real path by reflink where the filesystem can, else by
+   hardlink, else by copy. Identical files from any package or version
+   are stored once, and unpacking one the store already holds writes
+   nothing that reaches the disk. Hardlinked files share the object's
+   mtime of 0. */
+
+static void make_parents(const char *path) {
+    char d[1024];
+    snprintf(d, sizeof(d), "%s", path);
+    for (char *s = strchr(d + 1, '/'); s; s = strchr(s + 1, '/')) {
+        *s = 0;
+        mkdir(d, 0755);
+        *s = '/';
+    }
+}
+
+/* the entry's data into fd, hashed; holes stay holes */
+static int store_write(struct archive *a, struct archive_entry *e, int fd, EVP_MD_CTX *md, uint64_t *len) {
+    static const char zero[4096];
+    const void *buf; size_t sz; la_int64_t off;
+    uint64_t pos = 0, size = archive_entry_size(e);
+    for (;;) {
+        int r = archive_read_data_block(a, &buf, &sz, &off);
+        if (r == ARCHIVE_EOF) break;
+        if (r < ARCHIVE_OK) { fprintf(stderr, "%s\n", archive_error_string(a)); return -1; }
+        for (; pos < (uint64_t)off; pos += sizeof(zero) < off - pos ? sizeof(zero) : off - pos)
+            EVP_DigestUpdate(md, zero, sizeof(zero) < off - pos ? sizeof(zero) : off - pos);
+        for (size_t done = 0; done < sz; ) {
+            ssize_t w = pwrite(fd, (const char *)buf + done, sz - done, off + done);
+            if (w <= 0) return -1;
+            done += w;
+        }
+        EVP_DigestUpdate(md, buf, sz);
+        pos = off + sz;
+    }
+    for (; pos < size; pos += sizeof(zero) < size - pos ? sizeof(zero) : size - pos)
+        EVP_DigestUpdate(md, zero, sizeof(zero) < size - pos ? sizeof(zero) : size - pos);
+    *len = pos;
+    return ftruncate(fd, pos);
+}
+
+static int reflink_failed;      /* FICLONE said no once; don't keep asking */
+
+/* create tmp for path, making its directories on the first miss */
+static int open_new(const char *tmp, const char *path) {
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0 && errno == EEXIST && !unlink(tmp)) fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd < 0 && errno == ENOENT) {
+        make_parents(path);
+        fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    }
+    return fd;
+}
+
+static int link_new(const char *obj, const char *tmp, const char *path) {
+    if (!link(obj, tmp)) return 0;
+    if (errno == EEXIST && !unlink(tmp)) return link(obj, tmp);
+    if (errno != ENOENT) return -1;
+    make_parents(path);
+    return link(obj, tmp);
+}
+
+/* put obj at path: reflink, hardlink or copy into a temporary name next
+   to it, then rename over whatever was there */
+static int store_link(const char *obj, const char *path, time_t mtime) {
+    char tmp[1100];
+    snprintf(tmp, sizeof(tmp), "%s.mpkg-new", path);
+    int src = -1, dst = -1, err = 0;
+    struct stat st;
+    if (!reflink_failed) {
+        src = open(obj, O_RDONLY | O_CLOEXEC);
+        if (src < 0 || fstat(src, &st) || (dst = open_new(tmp, path)) < 0) err = 1;
+        else if (ioctl(dst, FICLONE, src)) {
+            reflink_failed = 1;
+            close(dst);
+            unlink(tmp);
+            dst = -1;
+        }
+    }
+    if (!err && dst < 0 && link_new(obj, tmp, path)) {
+        /* no hardlinks either (another filesystem): copy */
+        if (src < 0 && ((src = open(obj, O_RDONLY | O_CLOEXEC)) < 0 || fstat(src, &st))) err = 1;
+        else if ((dst = open_new(tmp, path)) < 0) err = 1;
+        for (off_t left = st.st_size; !err && left > 0; ) {
+            ssize_t n = copy_file_range(src, NULL, dst, NULL, left, 0);
+            if (n <= 0) err = 1;
+            left -= n;
+        }
+    }
+    if (dst >= 0) {
+        /* a copy of its own: give it the object's owner and mode, and the
+           entry's own mtime */
+        struct timespec ts[2] = { { mtime, 0 }, { mtime, 0 } };
+        if (!err && !geteuid() && fchown(dst, st.st_uid, st.st_gid)) err = 1;
+        if (!err && (fchmod(dst, st.st_mode & 07777) || futimens(dst, ts))) err = 1;
+        err |= close(dst) != 0;
+    }
+    if (src >= 0) close(src);
+    if (!err) err = rename(tmp, path) != 0;
+    if (err) { fprintf(stderr, "%s: %s\n", path, strerror(errno)); unlink(tmp); }
+    return err ? -1 : 0;
+}
+
+/* Unpack a regular file through the store. Fills in the digest and the
+   mtime the deployed file ends up with (hardlinks share the object's). */
+static int store_deploy(struct archive *a, struct archive_entry *e, const char *path,
+                        EVP_MD_CTX *md, uint64_t *len, char *hex, int64_t *mtime) {
+    char tmp[600], obj[700];
+    snprintf(tmp, sizeof(tmp), "%s/%s/tmp.XXXXXX", PKG_CACHE_PATH, STORE_DIR);
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd < 0) { fprintf(stderr, "%s: %s\n", tmp, strerror(errno)); return -1; }
+    int err = store_write(a, e, fd, md, len) != 0;
+    unsigned mode = archive_entry_perm(e);
+    uid_t uid = geteuid() ? geteuid() : archive_entry_uid(e);
+    gid_t gid = geteuid() ? getegid() : archive_entry_gid(e);
+    /* objects keep mtime 0, so a hardlinked copy edited in place gives
+       itself away and is not handed out again */
+    struct timespec ts[2] = { { 0, 0 }, { 0, 0 } };
+    if (!err && !geteuid()) err = fchown(fd, uid, gid) != 0;
+    if (!err) err = fchmod(fd, mode) || futimens(fd, ts);
+    err |= close(fd) != 0;
+    digest_hex(md, hex);
+    snprintf(obj, sizeof(obj), "%s/%s/%.2s/%s-%o-%u-%u", PKG_CACHE_PATH, STORE_DIR, hex, hex, mode, (unsigned)uid, (unsigned)gid);
+    /* first one in wins; a duplicate is dropped before it reaches the disk */
+    struct stat st;
+    if (!err && link_new(tmp, obj, obj)) {
+        if (errno != EEXIST) err = 1;
+        else if (lstat(obj, &st) || (uint64_t)st.st_size != *len || st.st_mtime) err = rename(tmp, obj) != 0;
+    }
+    if (err) fprintf(stderr, "%s: can't store: %s\n", path, strerror(errno));
+    unlink(tmp);
+    if (err || store_link(obj, path, archive_entry_mtime(e))) return -1;
+    *mtime = !lstat(path, &st) ? st.st_mtime : archive_entry_mtime(e);
+    return 0;
+}
+
+/* clean --store: drop objects no installed file links to. With reflinks
+   nothing links to them, so this empties the store. */
+int store_prune(void) {
+    char dir[512];
+    snprintf(dir, sizeof(dir), "%s/%s", PKG_CACHE_PATH, STORE_DIR);
+    DIR *top = opendir(dir);
+    if (!top) { printf("File store is empty\n"); return 0; }
+    unsigned long kept = 0, pruned = 0;
+    unsigned long long freed = 0;
+    struct dirent *t;
+    while ((t = readdir(top))) {
+        if (t->d_name[0] == '.' || strlen(t->d_name) != 2) continue;
+        int dfd = openat(dirfd(top), t->d_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *sub = dfd >= 0 ? fdopendir(dfd) : NULL;
+        if (!sub) { if (dfd >= 0) close(dfd); continue; }
+        struct dirent *o;
+        while ((o = readdir(sub))) {
+            struct stat st;
+            if (o->d_name[0] == '.' || fstatat(dfd, o->d_name, &st, AT_SYMLINK_NOFOLLOW)) continue;
+            if (st.st_nlink > 1) { kept++; continue; }
+            if (!unlinkat(dfd, o->d_name, 0)) { pruned++; freed += st.st_size; }
+        }
+        closedir(sub);
+        unlinkat(dirfd(top), t->d_name, AT_REMOVEDIR);
+    }
+    closedir(top);
+    printf("File store: %lu objects pruned (%llu bytes), %lu in use\n", pruned, freed, kept);
+    return 0;
+}
+
+/* Take path for package_name in the path index; *fresh is set when no
+   package owned it before, so a failed install knows what to give back. */
+int check_conflicts(const char *package_name, const char *path, int *fresh) {
+    char owner[256];
+    int r = pathidx_take(path, package_name, owner, sizeof(owner));
+    if (r < 0) { printf("Conflict: %s already owned by %s\n", path, owner); return -1; }
+    *fresh = r;
+    return 0;
+}
+
+static int path_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int dir_depth_cmp(const void *a, const void *b);
+
+/* Delete a path an update dropped: a file only if the package still
+   owned it, a directory if it is empty. */
+static void drop_path(const char *package_name, const char *path) {
+    char rp[1280];
+    const char *dp = root_path(path, rp, sizeof(rp));
+    if (!dp) return;
+    if (is_dir_entry(path)) rmdir(dp);
+    else if (pathidx_clear(path, package_name) || !pathidx_owner(path)) unlink(dp);
+}
+
+/* Swap in the new .files list. Files the previous version had but this
+   one doesn't are deleted, and so are its directories they leave empty. */
+static int write_manifest(const char *package_name, PathList *files, const PathList *meta, PathList *dirs) {
+    char log[512], tmp[600];
+    snprintf(log, sizeof(log), "%s/%s.files", PKG_DB_PATH, package_name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", log);
+    qsort(dirs->v, dirs->n, sizeof(char *), path_cmp);
+    /* files stays in step with meta; look names up in a sorted copy */
+    char **sorted = malloc((files->n + 1) * sizeof(char *));
+    if (files->n) memcpy(sorted, files->v, files->n * sizeof(char *));
+    qsort(sorted, files->n, sizeof(char *), path_cmp);
+    FILE *f = fopen(log, "r");
+    if (f) {
+        /* an update finds the directories already there; keep them ours
+           unless they end up empty */
+        char line[MANIFEST_LINE];
+        PathList keep = {0};
+        while (manifest_next(f, line, NULL)) {
+            char *key = line;
+            if (is_dir_entry(line)) {
+                if (!bsearch(&key, dirs->v, dirs->n, sizeof(char *), path_cmp)) path_list_add(&keep, line);
+            }
+            else if (!bsearch(&key, sorted, files->n, sizeof(char *), path_cmp)) {
+                journal_write("D %s\t%s\n", package_name, line);
+                drop_path(package_name, line);
+            }
+        }
+        fclose(f);
+        qsort(keep.v, keep.n, sizeof(char *), dir_depth_cmp);
+        for (int i = 0; i < keep.n; i++) {
+            char rp[1280];
+            const char *dp = root_path(keep.v[i], rp, sizeof(rp));
+            if (!dp || rmdir(dp)) path_list_add(dirs, keep.v[i]);
+            else journal_write("D %s\t%s\n", package_name, keep.v[i]);
+        }
+        path_list_free(&keep);
+    }
+    free(sorted);
+    f = fopen(tmp, "w");
+    if (!f) return -1;
+    for (int i = 0; i < files->n; i++) fprintf(f, "%s%s\n", files->v[i], meta->v[i]);
+    for (int i = 0; i < dirs->n; i++) fprintf(f, "%s\n", dirs->v[i]);
+    if (fclose(f)) { unlink(tmp); return -1; }
+    return rename(tmp, log);
+}
+
+/* One pass over the archive: PKGINFO, conflict checks and extraction
+   together, so the payload is decompressed exactly once. Each file is
+   checked against the path index just before it is written; on any
+   failure the files this pass created are removed again. If src is the
+   transfer feeding a, nothing is committed until all of it has arrived
+   and passed verification. Returns the PKGINFO (zeroed if the archive
+   has none) or NULL on failure. */
+Package* unpack_package(struct archive *a, const char *package_name, int flags, Stream *src) {
+    if (pathidx_open()) { fprintf(stderr, "Can't open path index\n"); return NULL; }
+    struct archive *ext = archive_write_disk_new();
+    /* root_path has resolved every link above dp inside the image, so
+       there libarchive may refuse any it meets; a live system has links
+       like /lib -> usr/lib that packages install through */
+    archive_write_disk_set_options(ext, ARCHIVE_EXTRACT_TIME|ARCHIVE_EXTRACT_PERM|ARCHIVE_EXTRACT_OWNER|
+                                   ARCHIVE_EXTRACT_SECURE_NODOTDOT|(*PKG_ROOT ? ARCHIVE_EXTRACT_SECURE_SYMLINKS : 0));
+    printf("Unpacking %s\n", package_name);
+    Span sp, lap, info = {0}, conf = {0};
+    span_begin(&sp);
+    uint64_t bytes = 0, nfiles = 0;
+    int stored = 0;
+    Package *pkg = NULL;
+    PathList files = {0}, meta = {0}, dirs = {0}, created = {0}, taken = {0};
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    int err = !md, r = ARCHIVE_OK;
+    struct archive_entry *e;
+    /* write to absolute paths rather than chdir("/"): the cwd is shared by
+       every thread, and packages may be unpacked concurrently */
+    while (!err && (r = archive_read_next_header(a, &e)) == ARCHIVE_OK) {
+        const char *name = archive_entry_pathname(e);
+        if (!pkg && is_pkginfo(name)) {
+            span_begin(&lap);
+            pkg = read_pkginfo_entry(a, e);
+            span_lap(&lap, &info);
+            if (flags & UNPACK_SHOW) {
+                printf(" name: %s\n version: %s\n arch: %s\n description: %s\n", pkg->name, pkg->version, pkg->arch, pkg->description);
+                if (*pkg->depends) printf(" depends: %s\n", pkg->depends);
+                if (pkg->size) printf(" size: %zu bytes\n", pkg->size);
+            }
+            if ((flags & UNPACK_DEPS) && *pkg->depends && check_dependencies(pkg->depends)) { err = 1; break; }
+            continue;
+        }
+        if (is_metadata(name)) { archive_read_data_skip(a); continue; }
+        if (PKG_VERBOSE) printf(" %s\n", name);
+        char p[1024], rp[1280];
+        abs_path(name, p, sizeof(p));
+        size_t n = strlen(p);
+        int isdir = archive_entry_filetype(e) == AE_IFDIR;
+        while (isdir && n > 1 && p[n-1] == '/') p[--n] = 0;
+        const char *dp = root_path(p, rp, sizeof(rp));
+        struct stat st;
+        if (!dp) { fprintf(stderr, "%s: %s: %s\n", package_name, name, strerror(errno)); err = 1; break; }
+        if (isdir) {
+            /* remember directories we create, so remove can prune them */
+            if (lstat(dp, &st) && n + 1 < sizeof(p)) {
+                char d[1024];
+                snprintf(d, sizeof(d), "%s/", p);
+                path_list_add(&dirs, d);
+                journal_write("N %s\t%s\n", package_name, d);
+            }
+        }
+        else if (archive_entry_filetype(e) == AE_IFREG || archive_entry_filetype(e) == AE_IFLNK) {
+            int fresh;
+            span_begin(&lap);
+            int clash = check_conflicts(package_name, p, &fresh);
+            span_lap(&lap, &conf);
+            if (clash) { err = 1; break; }
+            if (fresh) { path_list_add(&taken, p); journal_write("T %s\t%s\n", package_name, p); }
+            if (lstat(dp, &st)) { path_list_add(&created, dp); journal_write("N %s\t%s\n", package_name, p); }
+            path_list_add(&files, p);
+        }
+        archive_entry_set_pathname(e, dp);
+        const char *link = archive_entry_hardlink(e);
+        if (link) {
+            char lp[1024], rlp[1280];
+            abs_path(link, lp, sizeof(lp));
+            const char *dl = root_path(lp, rlp, sizeof(rlp));
+            if (!dl) { fprintf(stderr, "%s: %s: %s\n", package_name, link, strerror(errno)); err = 1; break; }
+            archive_entry_set_hardlink(e, dl);
+        }
+        /* record what a regular file should look like for doctor */
+        int reg = archive_entry_filetype(e) == AE_IFREG;
+        EVP_MD_CTX *h = reg && !link && EVP_DigestInit_ex(md, EVP_sha256(), NULL) ? md : NULL;
+        uint64_t len = 0;
+        char hex[2 * EVP_MAX_MD_SIZE + 1];
+        int64_t mtime = archive_entry_mtime(e);
+        if (h && PKG_FILE_STORE) {
+            if (store_deploy(a, e, dp, h, &len, hex, &mtime)) { err = 1; break; }
+            stored = 1;
+        }
+        else if (archive_write_header(ext, e) < ARCHIVE_WARN || copy_data(a, ext, h, &len) < ARCHIVE_WARN) {
+            const char *why = archive_error_string(ext);
+            fprintf(stderr, "%s: %s\n", dp, why ? why : archive_error_string(a));
+            err = 1;
+            break;
+        }
+        bytes += len;
+        if (!reg && archive_entry_filetype(e) != AE_IFLNK) continue;
+        nfiles++;
+        char m[128] = "";
+        if (h) {
+            if (!PKG_FILE_STORE) digest_hex(h, hex);
+            snprintf(m, sizeof(m), "\t%llu\t%o\t%lld\t%s", (unsigned long long)len,
+                     (unsigned)archive_entry_perm(e), (long long)mtime, hex);
+        }
+        path_list_add(&meta, m);
+    }
+    if (!err && r != ARCHIVE_EOF) {
+        fprintf(stderr, "%s: %s\n", package_name, archive_error_string(a));
+        err = 1;
+    }
+    archive_write_close(ext); archive_write_free(ext);
+    if (!err && src && stream_drain(src)) err = 1;
+    if (!err && txn.depth) {
+        if (!*PKG_ROOT) txn_files(&files);
+        if (stored) {
+            pthread_mutex_lock(&txn.lock);
+            devset_add(&txn.devs, PKG_CACHE_PATH);
+            pthread_mutex_unlock(&txn.lock);
+        }
+    }
+    else if (!err) {
+        DevSet ds = {0};
+        if (*PKG_ROOT) devset_add(&ds, PKG_ROOT);
+        else devset_files(&ds, &files);
+        if (stored) devset_add(&ds, PKG_CACHE_PATH);
+        if (devset_sync(&ds)) { fprintf(stderr, "Can't sync files of %s\n", package_name); err = 1; }
+    }
+    if (!err && write_manifest(package_name, &files, &meta, &dirs)) {
+        fprintf(stderr, "Can't write file list for %s\n", package_name);
+        err = 1;
+    }
+    if (err) {
+        char rp[1280];
+        for (int i = 0; i < created.n; i++) unlink(created.v[i]);
+        for (int i = dirs.n - 1; i >= 0; i--) {
+            const char *dp = root_path(dirs.v[i], rp, sizeof(rp));
+            if (dp) rmdir(dp);
+        }
+        for (int i = 0; i < taken.n; i++) pathidx_clear(taken.v[i], package_name);
+        if (created.n) printf("Rolled back %d files of %s\n", created.n, package_name);
+        free(pkg);
+        pkg = NULL;
+    } else if (!pkg) {
+        pkg = calloc(1, sizeof(Package));
+    }
+    pathidx_sync();
+    /* pkginfo and the per-file conflict checks are taken out of extract
+       and traced as if they ran back to back at the start */
+    if (timing.on) {
+        double wall = clock_sec(CLOCK_MONOTONIC) - sp.wall, cpu = clock_sec(CLOCK_THREAD_CPUTIME_ID) - sp.cpu;
+        timing_add(PH_PKGINFO, package_name, sp.wall, info.wall, info.cpu, 0, 0);
+        timing_add(PH_CONFLICTS, package_name, sp.wall + info.wall, conf.wall, conf.cpu, 0, nfiles);
+        timing_add(PH_EXTRACT, package_name, sp.wall + info.wall + conf.wall, wall - info.wall - conf.wall,
+                   cpu - info.cpu - conf.cpu, bytes, nfiles);
+    }
+    path_list_free(&files); path_list_free(&meta); path_list_free(&dirs);
+    path_list_free(&created); path_list_free(&taken);
+    EVP_MD_CTX_free(md);
+    return pkg;
+}
+
+static struct archive* archive_reader(void) {
+    struct archive *a = archive_read_new();
+    archive_read_support_format_all(a);
+    archive_read_support_filter_all(a);
+    return a;
+}
+
+#define DECODE_MIN (8 << 20)    /* smaller archives aren't worth the thread */
+#define DECODE_CHUNK (1 << 20)
+
+static const unsigned char xz_magic[6] = { 0xfd, '7', 'z', 'X', 'Z', 0 };
+static const unsigned char zstd_magic[4] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+enum { DECODE_NONE, DECODE_XZ, DECODE_ZSTD };
+
+/* which decoder stage, if any, takes an archive starting with magic */
+static int decode_kind(const unsigned char *magic, size_t n) {
+    if (n >= 6 && !memcmp(magic, xz_magic, 6)) return DECODE_XZ;
+    if (n >= 4 && !memcmp(magic, zstd_magic, 4)) return DECODE_ZSTD;
+    return DECODE_NONE;
+}
+
+static int decode_threads(void) {
+    if (PKG_DECODE_THREADS > 0) return PKG_DECODE_THREADS;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+/* Decode stage: a thread decompresses the input (a file or a transfer)
+   and queues plain tar data for the thread that parses it and writes
+   files. xz uses liblzma's multi-threaded decoder, so multi-block
+   archives (xz -T) decode on several cores; zstd and single-block xz
+   still overlap decoding with disk writes. */
+typedef struct {
+    lzma_stream lz;
+    ZSTD_DCtx *zs;      /* zstd instead of xz when set */
+    int fd;
+    Stream *in;
+    Stream *out;
+    uint64_t total;     /* bytes decoded */
+    pthread_t thread;
+    char label[256];
+} DecodePipe;
+
+static ssize_t pipe_pull(DecodePipe *x, uint8_t *buf) {
+    return x->in ? stream_pull(x->in, buf, DECODE_CHUNK) : read(x->fd, buf, DECODE_CHUNK);
+}
+
+static int xz_decode(DecodePipe *x, uint8_t *ibuf, uint8_t *obuf) {
+    lzma_action act = LZMA_RUN;
+    x->lz.next_out = obuf;
+    x->lz.avail_out = DECODE_CHUNK;
+    for (;;) {
+        if (!x->lz.avail_in && act == LZMA_RUN) {
+            ssize_t n = pipe_pull(x, ibuf);
+            if (n < 0) return -1;
+            if (!n) act = LZMA_FINISH;
+            x->lz.next_in = ibuf;
+            x->lz.avail_in = n;
+        }
+        lzma_ret r = lzma_code(&x->lz, act);
+        if (!x->lz.avail_out || r == LZMA_STREAM_END) {
+            size_t n = DECODE_CHUNK - x->lz.avail_out;
+            if (n && stream_put(x->out, (char *)obuf, n) != n) return 0;
+            x->total += n;
+            x->lz.next_out = obuf;
+            x->lz.avail_out = DECODE_CHUNK;
+        }
+        if (r == LZMA_STREAM_END) return 0;
+        if (r != LZMA_OK) { fprintf(stderr, "%s: xz decode error %d\n", x->label, r); return -1; }
+    }
+}
+
+static int zstd_decode(DecodePipe *x, uint8_t *ibuf, uint8_t *obuf) {
+    ZSTD_inBuffer in = { ibuf, 0, 0 };
+    size_t ret = 0;
+    int flushed = 1;
+    for (;;) {
+        /* only read on once the decoder has nothing left to hand out */
+        if (in.pos == in.size && flushed) {
+            ssize_t n = pipe_pull(x, ibuf);
+            if (n < 0) return -1;
+            if (!n) break;
+            in.size = n;
+            in.pos = 0;
+        }
+        ZSTD_outBuffer o = { obuf, DECODE_CHUNK, 0 };
+        ret = ZSTD_decompressStream(x->zs, &o, &in);
+        if (ZSTD_isError(ret)) { fprintf(stderr, "%s: %s\n", x->label, ZSTD_getErrorName(ret)); return -1; }
+        flushed = o.pos < o.size;
+        if (o.pos && stream_put(x->out, (char *)obuf, o.pos) != o.pos) return 0;
+        x->total += o.pos;
+    }
+    if (ret) { fprintf(stderr, "%s: truncated zstd stream\n", x->label); return -1; }
+    return 0;
+}
+
+static void* decode_thread(void *arg) {
+    DecodePipe *x = arg;
+    Span sp;
+    span_begin(&sp);
+    uint8_t *ibuf = malloc(DECODE_CHUNK), *obuf = malloc(DECODE_CHUNK);
+    int err = x->zs ? zstd_decode(x, ibuf, obuf) : xz_decode(x, ibuf, obuf);
+    stream_finish(x->out, err != 0);
+    free(ibuf); free(obuf);
+    /* CPU of this thread only: liblzma's decoder threads aren't counted */
+    span_end(&sp, PH_DECODE, x->label, x->total, 0);
+    return NULL;
+}
+
+static la_ssize_t pipe_read(struct archive *a, void *data, const void **out) {
+    return stream_read(a, ((DecodePipe *)data)->out, out);
+}
+
+static void pipe_free(DecodePipe *x) {
+    lzma_end(&x->lz);
+    ZSTD_freeDCtx(x->zs);
+    if (x->fd >= 0) close(x->fd);
+    stream_free(x->out);
+    free(x);
+}
+
+static int pipe_close(struct archive *a, void *data) {
+    (void)a;
+    DecodePipe *x = data;
+    stream_cancel(x->out);
+    pthread_join(x->thread, NULL);
+    pipe_free(x);
+    return ARCHIVE_OK;
+}
+
+/* takes ownership of fd; NULL if the decoder could not be set up */
+static struct archive* open_decode_pipe(int kind, int fd, Stream *in, const char *label) {
+    DecodePipe *x = calloc(1, sizeof(DecodePipe));
+    x->fd = fd;
+    x->in = in;
+    x->lz = (lzma_stream)LZMA_STREAM_INIT;
+    snprintf(x->label, sizeof(x->label), "%s", label);
+    int err;
+    if (kind == DECODE_ZSTD) {
+        x->zs = ZSTD_createDCtx();
+        /* allow the large windows of zstd --long */
+        err = !x->zs || ZSTD_isError(ZSTD_DCtx_setParameter(x->zs, ZSTD_d_windowLogMax, sizeof(size_t) == 4 ? 30 : 31));
+    } else {
+        lzma_mt mt = { 0 };
+        mt.threads = decode_threads();
+        mt.flags = LZMA_CONCATENATED;
+        mt.memlimit_threading = lzma_physmem() / 4;
+        mt.memlimit_stop = UINT64_MAX;
+        err = lzma_stream_decoder_mt(&x->lz, &mt) != LZMA_OK;
+    }
+    x->out = stream_new(8 << 20, DECODE_CHUNK);
+    x->out->nopause = 1;
+    if (err || pthread_create(&x->thread, NULL, decode_thread, x)) {
+        pipe_free(x);
+        return NULL;
+    }
+    struct archive *a = archive_reader();
+    if (archive_read_open(a, x, NULL, pipe_read, pipe_close)) {
+        archive_read_free(a);
+        return NULL;
+    }
+    return a;
+}
+
+static struct archive* open_archive(const char *path, const char *package_name) {
+    int fd = open(path, O_RDONLY), kind = DECODE_NONE;
+    unsigned char magic[6];
+    struct stat st;
+    if (fd >= 0 && decode_threads() > 1 && !fstat(fd, &st) && st.st_size >= DECODE_MIN &&
+        pread(fd, magic, 6, 0) == 6)
+        kind = decode_kind(magic, 6);
+    if (kind != DECODE_NONE) {
+        struct archive *a = open_decode_pipe(kind, fd, NULL, package_name);
+        if (a) return a;
+        fd = -1;
+    }
+    if (fd >= 0) close(fd);
+    struct archive *a = archive_reader();
+    if (archive_read_open_filename(a, path, 65536)) {
+        fprintf(stderr, "%s: %s\n", path, archive_error_string(a));
+        archive_read_free(a);
+        return NULL;
+    }
+    return a;
+}
+
+static struct archive* open_cached(const char *package_name) {
+    char path[512];
+    cache_path(package_name, path, sizeof(path));
+    return open_archive(path, package_name);
+}
+
+static struct archive* open_stream(Stream *st, const char *package_name) {
+    unsigned char magic[6];
+    int kind = decode_threads() > 1 ? decode_kind(magic, stream_peek(st, magic, 6)) : DECODE_NONE;
+    if (kind != DECODE_NONE) {
+        struct archive *a = open_decode_pipe(kind, -1, st, package_name);
+        if (a) return a;
+    }
+    struct archive *a = archive_reader();
+    if (archive_read_open(a, st, NULL, stream_read, NULL)) {
+        archive_read_free(a);
+        return NULL;
+    }
+    return a;
+}
+
+int extract_package(const char *package_name) {
+    struct archive *a = open_cached(package_name);
+    if (!a) return -1;
+    Package *pkg = unpack_package(a, package_name, 0, NULL);
+    archive_read_close(a); archive_read_free(a);
+    int r = pkg ? 0 : -1;
+    free(pkg);
+    return r;
+}
+
+void log_action(const char *action, const char *package_name, int status) {
+    FILE *f = fopen(LOG_FILE, "a");
+    if (!f) return;
+    time_t t = time(NULL);
+    fprintf(f, "[%s] %s %s: %s\n", ctime(&t), action, package_name, status ? "failed" : "success");
+    fclose(f);
+}
+
+int mark_installed(const char *package_name, Package *pkg) {
+    Span sp;
+    span_begin(&sp);
+    Package rec;
+    if (pkg) rec = *pkg;
+    else memset(&rec, 0, sizeof(rec));
+    strncpy(rec.name, package_name, sizeof(rec.name)-1);
+    rec.install_time = time(NULL);
+    pkgdb_put(&rec);
+    int r = 0;
+    if (!txn.depth) r = pkgdb_commit();
+    else {
+        for (char *c = rec.description; *c; c++) if (*c == '\t') *c = ' ';
+        journal_write("I %s\t%s\t%s\t%zu\t%ld\t%s\t%s\t%u\n", rec.name, rec.version, rec.arch,
+                      rec.size, (long)rec.install_time, rec.depends, rec.description, rec.flags);
+    }
+    span_end(&sp, PH_DB, package_name, 0, 0);
+    return r;
+}
+
+Package* read_installed_package(const char *package_name) {
+    Package *pkg = malloc(sizeof(Package));
+    if (!pkgdb_get(package_name, pkg)) { free(pkg); return NULL; }
+    return pkg;
+}
+
+static Package* read_legacy_package(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) return NULL;
+    Package *pkg = malloc(sizeof(Package));
+    memset(pkg, 0, sizeof(Package));
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (!strncmp(line, "name=", 5)) strncpy(pkg->name, line+5, sizeof(pkg->name)-1);
+        else if (!strncmp(line, "version=", 8)) strncpy(pkg->version, line+8, sizeof(pkg->version)-1);
+        else if (!strncmp(line, "arch=", 5)) strncpy(pkg->arch, line+5, sizeof(pkg->arch)-1);
+        else if (!strncmp(line, "description=", 12)) strncpy(pkg->description, line+12, sizeof(pkg->description)-1);
+        else if (!strncmp(line, "depends=", 8)) strncpy(pkg->depends, line+8, sizeof(pkg->depends)-1);
+        else if (!strncmp(line, "size=", 5)) pkg->size = atol(line+5);
+        else if (!strncmp(line, "install_time=", 13)) pkg->install_time = atol(line+13);
+    }
+    fclose(f);
+    return pkg;
+}
+
+int sync_repository(void) {
+    Download d = { "repo.db", "repo.db" };
+    mirror_load();
+    if (mirrors.n > 1) mirror_probe(1);
+    snprintf(d.out, sizeof(d.out), "%s/repo.db", PKG_DB_PATH);
+    if (download_one(&d)) { fprintf(stderr, "Failed to sync repo\n"); return -1; }
+    if (repo_compile()) { fprintf(stderr, "Failed to index repo.db\n"); return -1; }
+    if (search_build()) fprintf(stderr, "Warning: failed to build the search index\n");
+    log_action("sync", "repository", 0);
+    printf("Repository synced\n");
+    return 0;
+}
+
+/* rpm-style comparison: digit runs numerically, letter runs
+   lexically, a digit run beats a letter run, and a longer version wins
+   when one is a prefix of the other (1.0 < 1.0.1) */
+int vercmp(const char *a, const char *b) {
+    for (;;) {
+        while (*a && !isalnum((unsigned char)*a)) a++;
+        while (*b && !isalnum((unsigned char)*b)) b++;
+        if (!*a || !*b) return !*a && !*b ? 0 : *a ? 1 : -1;
+        int num = !!isdigit((unsigned char)*a);
+        if (num != !!isdigit((unsigned char)*b)) return num ? 1 : -1;
+        const char *ea = a, *eb = b;
+        if (num) {
+            while (*a == '0') a++;
+            while (*b == '0') b++;
+            for (ea = a; isdigit((unsigned char)*ea); ea++);
+            for (eb = b; isdigit((unsigned char)*eb); eb++);
+            if (ea - a != eb - b) return ea - a > eb - b ? 1 : -1;
+        } else {
+            for (; isalpha((unsigned char)*ea); ea++);
+            for (; isalpha((unsigned char)*eb); eb++);
+        }
+        size_t la = ea - a, lb = eb - b;
+        int c = strncmp(a, b, la < lb ? la : lb);
+        if (c) return c > 0 ? 1 : -1;
+        if (la != lb) return la > lb ? 1 : -1;
+        a = ea; b = eb;
+    }
+}
+
+int update_package(const char *package_name) {
+    Package *local = read_installed_package(package_name);
+    if (!local) { printf("%s not installed\n", package_name); return -1; }
+    const RepoEntry *r = repo_open() ? NULL : repo_find(package_name);
+    if (!r) { printf("%s not found in repository\n", package_name); free(local); return -1; }
+    const char *ver = RS(r->version);
+    if (vercmp(ver, local->version) <= 0) { printf("%s is up to date\n", package_name); free(local); return 0; }
+    printf("Updating %s %s to %s\n", package_name, local->version, ver);
+    free(local);
+    const char *names[1] = { package_name };
+    int failed;
+    if (txn_begin("update")) return -1;
+    int err = install_level(names, NULL, &failed, 1, 1);
+    return txn_commit() || err ? -1 : 0;
+}
+
+static int pkg_name_cmp(const void *a, const void *b) {
+    return strcmp(((const Package *)a)->name, ((const Package *)b)->name);
+}
+
+static void parse_sha256(const char *hex, char *out) {
+    int i;
+    for (i = 0; i < 64 && isxdigit((unsigned char)hex[i]); i++) out[i] = tolower((unsigned char)hex[i]);
+    out[i == 64 && !hex[64] ? 64 : 0] = 0;
+}
+
+#define REPO_MAX_DELTAS 4
+
+/* a repo.db stanza: PKGINFO fields plus what only the repo knows */
+typedef struct {
+    Package p;
+    uint64_t csize;
+    char sha256[65];
+    char format[32];
+    struct { char from[65]; char file[256]; uint64_t size; } delta[REPO_MAX_DELTAS];
+    int ndelta;
+} RepoSrc;
+
+/* format=tar.zst: the suffix the archive is published under */
+static void parse_format(const char *val, RepoSrc *rs) {
+    size_t n = strlen(val);
+    if (!n || n >= sizeof(rs->format) || val[strspn(val, "abcdefghijklmnopqrstuvwxyz0123456789.")] || *val == '.') return;
+    strcpy(rs->format, val);
+}
+
+/* delta=<from sha256> <file> <size> */
+static void parse_delta(const char *val, RepoSrc *rs) {
+    char from[128], file[256];
+    unsigned long long size;
+    if (rs->ndelta == REPO_MAX_DELTAS || sscanf(val, "%127s %255s %llu", from, file, &size) != 3) return;
+    parse_sha256(from, rs->delta[rs->ndelta].from);
+    if (!*rs->delta[rs->ndelta].from) return;
+    strcpy(rs->delta[rs->ndelta].file, file);
+    rs->delta[rs->ndelta++].size = size;
+}
+
+static int repo_map(void) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, REPOIDX_FILE);
+    if (repo.map) munmap(repo.map, repo.len);
+    memset(&repo, 0, sizeof(repo));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 1;
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(RepoHeader)) { close(fd); return 1; }
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+    const RepoHeader *h = m;
+    if (memcmp(h->magic, REPOIDX_MAGIC, 8) || h->version != REPOIDX_VERSION ||
+        h->strings + h->strings_len > (uint64_t)st.st_size) {
+        munmap(m, st.st_size);
+        return 1;
+    }
+    repo.map = m; repo.len = st.st_size; repo.hdr = h;
+    repo.ent = (const RepoEntry *)((const char *)m + h->entries);
+    repo.slot = (const uint32_t *)((const char *)m + h->slots);
+    repo.dep = (const RepoDep *)((const char *)m + h->deps);
+    repo.delta = (const RepoDelta *)((const char *)m + h->deltas);
+    repo.str = (const char *)m + h->strings;
+    return 0;
+}
+
+/* Parse the text repo.db once and write repo.idx next to it. */
+int repo_compile(void) {
+    char src[512], path[512], tmp[512];
+    snprintf(src, sizeof(src), "%s/repo.db", PKG_DB_PATH);
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, REPOIDX_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE *f = fopen(src, "r");
+    if (!f) return -1;
+    struct stat st;
+    fstat(fileno(f), &st);
+    RepoSrc *v = NULL, *rs = NULL;
+    Package *p = NULL;
+    int n = 0, cap = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = 0;
+        if (!strncmp(line, "name=", 5)) {
+            if (n == cap) {
+                cap = cap ? cap * 2 : 256;
+                v = realloc(v, cap * sizeof(RepoSrc));
+            }
+            rs = &v[n++];
+            memset(rs, 0, sizeof(*rs));
+            p = &rs->p;
+            strncpy(p->name, line+5, sizeof(p->name)-1);
+        }
+        else if (!p) continue;
+        else if (!strncmp(line, "version=", 8)) strncpy(p->version, line+8, sizeof(p->version)-1);
+        else if (!strncmp(line, "arch=", 5)) strncpy(p->arch, line+5, sizeof(p->arch)-1);
+        else if (!strncmp(line, "description=", 12)) strncpy(p->description, line+12, sizeof(p->description)-1);
+        else if (!strncmp(line, "depends=", 8)) strncpy(p->depends, line+8, sizeof(p->depends)-1);
+        else if (!strncmp(line, "size=", 5)) p->size = atol(line+5);
+        else if (!strncmp(line, "csize=", 6)) rs->csize = strtoull(line+6, NULL, 10);
+        else if (!strncmp(line, "sha256=", 7)) parse_sha256(line+7, rs->sha256);
+        else if (!strncmp(line, "delta=", 6)) parse_delta(line+6, rs);
+        else if (!strncmp(line, "format=", 7)) parse_format(line+7, rs);
+    }
+    fclose(f);
+    qsort(v, n, sizeof(RepoSrc), pkg_name_cmp);
+
+    RepoEntry *ent = calloc(n + 1, sizeof(RepoEntry));
+    RepoDep *deps = NULL;
+    uint32_t ndeps = 0, depcap = 0;
+    RepoDelta *deltas = NULL;
+    uint32_t ndeltas = 0, deltacap = 0;
+    uint32_t nslots = 64;
+    while (nslots < (uint32_t)n * 2) nslots *= 2;
+    uint32_t *slots = calloc(nslots, sizeof(uint32_t));
+    StrPool sp = { calloc(1, 4096), 1, 4096 };
+    InternTab it = {0};
+    for (int i = 0; i < n; i++) {
+        RepoEntry *e = &ent[i];
+        const Package *pi = &v[i].p;
+        e->name = pool_add(&sp, pi->name);
+        e->version = pool_intern(&sp, &it, pi->version);
+        e->arch = pool_intern(&sp, &it, pi->arch);
+        e->description = pool_add(&sp, pi->description);
+        e->depends = pool_intern(&sp, &it, pi->depends);
+        e->size = pi->size;
+        e->sha256 = *v[i].sha256 ? pool_add(&sp, v[i].sha256) : 0;
+        e->csize = v[i].csize;
+        e->format = *v[i].format && strcmp(v[i].format, "tar.xz") ? pool_intern(&sp, &it, v[i].format) : 0;
+        e->deltas = ndeltas;
+        for (int k = 0; k < v[i].ndelta && e->sha256; k++) {
+            if (ndeltas == deltacap) {
+                deltacap = deltacap ? deltacap * 2 : 64;
+                deltas = realloc(deltas, deltacap * sizeof(RepoDelta));
+            }
+            deltas[ndeltas].from = pool_intern(&sp, &it, v[i].delta[k].from);
+            deltas[ndeltas].file = pool_add(&sp, v[i].delta[k].file);
+            deltas[ndeltas++].size = v[i].delta[k].size;
+            e->ndeltas++;
+        }
+        e->deps = ndeps;
+        const char *cur = pi->depends;
+        char dep[256];
+        while (dep_next(&cur, dep, sizeof(dep))) {
+            if (ndeps == depcap) {
+                depcap = depcap ? depcap * 2 : 256;
+                deps = realloc(deps, depcap * sizeof(RepoDep));
+            }
+            Package key;
+            strncpy(key.name, dep, sizeof(key.name));
+            RepoSrc *hit = bsearch(&key, v, n, sizeof(RepoSrc), pkg_name_cmp);
+            deps[ndeps].name = pool_intern(&sp, &it, dep);
+            deps[ndeps++].entry = hit ? (uint32_t)(hit - v) : REPO_NONE;
+            e->ndeps++;
+        }
+        uint32_t j;
+        for (j = path_hash(pi->name) & (nslots - 1); slots[j]; j = (j + 1) & (nslots - 1));
+        slots[j] = i + 1;
+    }
+    intern_free(&it);
+    free(v);
+
+    RepoHeader h = {0};
+    memcpy(h.magic, REPOIDX_MAGIC, 8);
+    h.version = REPOIDX_VERSION;
+    h.count = n;
+    h.nslots = nslots;
+    h.ndeps = ndeps;
+    h.src_size = st.st_size;
+    h.src_mtime = st.st_mtime;
+    h.entries = sizeof(h);
+    h.slots = h.entries + (uint64_t)n * sizeof(RepoEntry);
+    h.deps = h.slots + (uint64_t)nslots * sizeof(uint32_t);
+    h.ndeltas = ndeltas;
+    h.deltas = h.deps + (uint64_t)ndeps * sizeof(RepoDep);
+    h.strings = h.deltas + (uint64_t)ndeltas * sizeof(RepoDelta);
+    h.strings_len = sp.len;
+    f = fopen(tmp, "w");
+    int err = !f;
+    if (f) {
+        err = fwrite(&h, sizeof(h), 1, f) != 1 ||
+              fwrite(ent, sizeof(RepoEntry), n, f) != (size_t)n ||
+              fwrite(slots, sizeof(uint32_t), nslots, f) != nslots ||
+              fwrite(deps, sizeof(RepoDep), ndeps, f) != ndeps ||
+              fwrite(deltas, sizeof(RepoDelta), ndeltas, f) != ndeltas ||
+              fwrite(sp.buf, 1, sp.len, f) != sp.len;
+        err |= fclose(f) != 0;
+        if (!err) err = rename(tmp, path) != 0;
+        if (err) unlink(tmp);
+    }
+    free(ent); free(deps); free(deltas); free(slots); free(sp.buf);
+    if (err) { fprintf(stderr, "Failed to write %s\n", path); return -1; }
+    return repo_map();
+}
+
+/* Map repo.idx, rebuilding it if repo.db changed underneath.
+   Returns 1 when there is no repo.db at all. */
+int repo_open(void) {
+    if (repo.hdr) return 0;
+    char src[512];
+    snprintf(src, sizeof(src), "%s/repo.db", PKG_DB_PATH);
+    struct stat st;
+    int have_src = stat(src, &st) == 0;
+    int r = repo_map();
+    if (r < 0) return -1;
+    if (!r && (!have_src || (repo.hdr->src_size == (uint64_t)st.st_size && repo.hdr->src_mtime == st.st_mtime)))
+        return 0;
+    if (!have_src) return 1;
+    return repo_compile();
+}
+
+/* like repo_open(), but fetch repo.db first if we have never synced */
+int repo_load(void) {
+    int r = repo_open();
+    if (r > 0) {
+        if (sync_repository()) return -1;
+        r = repo_open();
+    }
+    return r ? -1 : 0;
+}
+
+const RepoEntry* repo_find(const char *name) {
+    if (!repo.hdr || !repo.hdr->count) return NULL;
+    uint32_t mask = repo.hdr->nslots - 1;
+    for (uint32_t j = path_hash(name) & mask; repo.slot[j]; j = (j + 1) & mask) {
+        const RepoEntry *e = &repo.ent[repo.slot[j] - 1];
+        if (!strcmp(RS(e->name), name)) return e;
+    }
+    return NULL;
+}
+
+typedef struct {
+    const char *name;
+    int *deps;
+    int ndeps;
+    int level;
+    int state;          /* 0 new, 1 on the DFS stack, 2 resolved */
+    int failed;
+    int wanted;         /* asked for by name, not pulled in */
+} DepNode;
+
+typedef struct {
+    DepNode *v;
+    int n, cap;
+    int *slot;          /* name hash -> node index + 1 */
+    int nslots;
+    int *stack;
+    int depth;
+} DepGraph;
+
+static int graph_find(DepGraph *g, const char *name) {
+    if (!g->nslots) return -1;
+    for (int i = path_hash(name) & (g->nslots - 1);; i = (i + 1) & (g->nslots - 1)) {
+        if (!g->slot[i]) return -1;
+        if (!strcmp(g->v[g->slot[i] - 1].name, name)) return g->slot[i] - 1;
+    }
+}
+
+static int graph_add(DepGraph *g, const char *name) {
+    if ((g->n + 1) * 2 > g->nslots) {
+        g->nslots = g->nslots ? g->nslots * 2 : 64;
+        free(g->slot);
+        g->slot = calloc(g->nslots, sizeof(int));
+        for (int k = 0; k < g->n; k++) {
+            int i;
+            for (i = path_hash(g->v[k].name) & (g->nslots - 1); g->slot[i]; i = (i + 1) & (g->nslots - 1));
+            g->slot[i] = k + 1;
+        }
+    }
+    if (g->n == g->cap) {
+        g->cap = g->cap ? g->cap * 2 : 32;
+        g->v = realloc(g->v, g->cap * sizeof(DepNode));
+        g->stack = realloc(g->stack, g->cap * sizeof(int));
+    }
+    DepNode *d = &g->v[g->n];
+    memset(d, 0, sizeof(*d));
+    d->name = name;
+    int i;
+    for (i = path_hash(name) & (g->nslots - 1); g->slot[i]; i = (i + 1) & (g->nslots - 1));
+    g->slot[i] = g->n + 1;
+    return g->n++;
+}
+
+static void graph_free(DepGraph *g) {
+    for (int i = 0; i < g->n; i++) free(g->v[i].deps);
+    free(g->v); free(g->slot); free(g->stack);
+}
+
+/* Depth-first walk over repo metadata. Returns the node index, -2 for a
+   package that is already installed, -1 on a missing package or a cycle. */
+static int resolve_visit(DepGraph *g, const char *name) {
+    int k = graph_find(g, name);
+    if (k >= 0) {
+        if (g->v[k].state != 1) return k;
+        fprintf(stderr, "Dependency cycle: ");
+        int from = g->depth - 1;
+        while (from > 0 && g->stack[from] != k) from--;
+        for (int i = from; i < g->depth; i++) fprintf(stderr, "%s -> ", g->v[g->stack[i]].name);
+        fprintf(stderr, "%s\n", name);
+        return -1;
+    }
+    if (is_installed(name)) return -2;
+    const RepoEntry *r = repo_find(name);
+    if (!r) {
+        if (g->depth) fprintf(stderr, "%s (needed by %s) not found in repository\n", name, g->v[g->stack[g->depth-1]].name);
+        else fprintf(stderr, "%s not found in repository\n", name);
+        return -1;
+    }
+    k = graph_add(g, RS(r->name));
+    g->v[k].state = 1;
+    g->stack[g->depth++] = k;
+    for (uint32_t i = 0; i < r->ndeps; i++) {
+        int d = resolve_visit(g, RS(repo.dep[r->deps + i].name));
+        if (d == -1) return -1;
+        if (d < 0) continue;
+        g->v[k].deps = realloc(g->v[k].deps, (g->v[k].ndeps + 1) * sizeof(int));
+        g->v[k].deps[g->v[k].ndeps++] = d;
+        if (g->v[d].level + 1 > g->v[k].level) g->v[k].level = g->v[d].level + 1;
+    }
+    g->depth--;
+    g->v[k].state = 2;
+    return k;
+}
+
+typedef struct {
+    DownloadBatch b;
+    const char **names;
+    const uint32_t *flags;      /* install reasons, NULL: explicit */
+    int *failed;
+    int next;
+    int update;
+    pthread_mutex_t lock;
+} LevelJob;
+
+static void* level_worker(void *arg) {
+    LevelJob *j = arg;
+    for (;;) {
+        pthread_mutex_lock(&j->lock);
+        int i = j->next++;
+        pthread_mutex_unlock(&j->lock);
+        if (i >= j->b.n) return NULL;
+        Download *d = &j->b.items[i];
+        Stream *st = d->stream;
+        uint32_t flags = j->flags ? j->flags[i] : 0;
+        if (!st) {
+            int bad = download_wait(&j->b, i);
+            if (d->base[0] && (bad || delta_apply(d))) {
+                printf("Delta for %s failed, fetching the full package\n", j->names[i]);
+                Download full;
+                package_download(&full, j->names[i]);
+                bad = download_one(&full);
+            }
+            j->failed[i] = bad || install_downloaded(j->names[i], j->update, flags);
+            continue;
+        }
+        /* on success the whole transfer has been read and verified */
+        j->failed[i] = install_from(open_stream(st, j->names[i]), j->names[i], j->update, flags, st) != 0;
+        if (j->failed[i]) stream_cancel(st);
+        download_wait(&j->b, i);
+    }
+}
+
+/* Download and unpack one level of the DAG: nothing in it depends on
+   anything else in it, so every package can proceed at once. */
+static int install_level(const char **names, const uint32_t *flags, int *failed, int n, int update) {
+    LevelJob j = { { calloc(n, sizeof(Download)), n }, names, flags, failed, 0, update };
+    pthread_mutex_init(&j.lock, NULL);
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nw = ncpu < 1 ? 1 : ncpu > n ? n : ncpu;
+    /* Workers take packages in order, so the first nw are read from as
+       soon as they arrive. Only those stream: a file:// transfer blocks
+       the download thread while its buffer is full, and must never wait
+       on a package no worker has reached. The rest go through the cache
+       while the workers are busy. Updates never stream: a bad checksum
+       is only known once the last file is out, and by then the old
+       version's files have been overwritten. */
+    for (int i = 0; i < n; i++) {
+        Download *d = &j.b.items[i];
+        package_download(d, names[i]);
+        if (d->cached || package_delta(d, names[i])) continue;
+        if (PKG_STREAM_INSTALL && i < nw && !is_installed(names[i])) d->stream = stream_new(STREAM_BUF, 65536);
+    }
+    int err = 0;
+    if (download_start(&j.b)) {
+        for (int i = 0; i < n; i++) failed[i] = 1;
+        err = n;
+    } else {
+        pthread_t *tids = malloc(nw * sizeof(pthread_t));
+        for (int w = 0; w < nw; w++) pthread_create(&tids[w], NULL, level_worker, &j);
+        for (int w = 0; w < nw; w++) pthread_join(tids[w], NULL);
+        free(tids);
+        download_finish(&j.b);
+        for (int i = 0; i < n; i++) err += failed[i];
+    }
+    pthread_mutex_destroy(&j.lock);
+    for (int i = 0; i < n; i++) stream_free(j.b.items[i].stream);
+    free(j.b.items);
+    return err;
+}
+
+/* Levels keep a live system usable at every step. An image under --root
+   isn't used until it is complete, so there the whole set is one level
+   and dependencies are only checked by the resolver. */
+static int install_graph(DepGraph *g) {
+    int maxlevel = -1;
+    if (*PKG_ROOT) for (int k = 0; k < g->n; k++) g->v[k].level = 0;
+    for (int k = 0; k < g->n; k++) if (g->v[k].level > maxlevel) maxlevel = g->v[k].level;
+    const char **names = malloc((g->n + 1) * sizeof(char *));
+    uint32_t *flags = malloc((g->n + 1) * sizeof(uint32_t));
+    int *idx = malloc((g->n + 1) * sizeof(int));
+    int *failed = malloc((g->n + 1) * sizeof(int));
+    int err = 0;
+    for (int level = 0; level <= maxlevel; level++) {
+        int n = 0;
+        for (int k = 0; k < g->n; k++) {
+            if (g->v[k].level != level) continue;
+            int d;
+            for (d = 0; d < g->v[k].ndeps && !g->v[g->v[k].deps[d]].failed; d++);
+            if (d < g->v[k].ndeps) {
+                fprintf(stderr, "Skipping %s: dependency %s failed\n", g->v[k].name, g->v[g->v[k].deps[d]].name);
+                g->v[k].failed = 1;
+                err++;
+                continue;
+            }
+            idx[n] = k;
+            flags[n] = g->v[k].wanted ? 0 : DB_AUTO;
+            names[n++] = g->v[k].name;
+        }
+        if (!n) continue;
+        err += install_level(names, flags, failed, n, 0);
+        for (int i = 0; i < n; i++) g->v[idx[i]].failed = failed[i];
+    }
+    free(names); free(flags); free(idx); free(failed);
+    return err;
+}
+
+/* asking for a package by name makes it explicit, even if it first
+   came in as a dependency */
+static void mark_explicit(const char *name) {
+    Package p;
+    printf("%s is already installed\n", name);
+    if (!pkgdb_get(name, &p) || !(p.flags & DB_AUTO)) return;
+    p.flags &= ~DB_AUTO;
+    pkgdb_put(&p);
+    if (!pkgdb_commit()) printf("%s is now marked as explicitly installed\n", name);
+}
+
+/* Resolve the requested packages and everything they pull in from
+   repo.db, then install the DAG level by level. Only the requested ones
+   are explicit; the rest are DB_AUTO, for autoremove. */
+int install_multiple_packages(int count, char *packages[]) {
+    if (repo_load()) { fprintf(stderr, "Can't load repo.db\n"); return count; }
+    DepGraph g = {0};
+    for (int i = 0; i < count; i++) {
+        int k = resolve_visit(&g, packages[i]);
+        if (k == -2) mark_explicit(packages[i]);
+        if (k == -1) { graph_free(&g); return count; }
+        if (k >= 0) g.v[k].wanted = 1;
+    }
+    if (g.n > count) {
+        printf("Resolving dependencies: %d packages to install\n", g.n);
+        for (int k = 0; k < g.n; k++) printf(" %s\n", g.v[k].name);
+    }
+    if (!g.n) { graph_free(&g); return 0; }
+    if (txn_begin("install")) { graph_free(&g); return count; }
+    int err = install_graph(&g);
+    if (txn_commit()) err = count;
+    graph_free(&g);
+    return err;
+}
+
+/* One pass over the installed set against the repo index, then every
+   outdated package goes through a single download/unpack pipeline. */
+int upgrade_packages(void) {
+    if (repo_load()) { fprintf(stderr, "Can't load repo.db\n"); return 1; }
+    uint32_t total = db.hdr ? db.hdr->count : 0;
+    const char **names = malloc((total + 1) * sizeof(char *));
+    int *failed = malloc((total + 1) * sizeof(int));
+    int n = 0;
+    DepGraph g = {0};
+    for (uint32_t i = 0; i < total; i++) {
+        const DbRecord *rec = &db.rec[i];
+        const RepoEntry *r = repo_find(DB_STR(rec->name));
+        if (!r || vercmp(RS(r->version), DB_STR(rec->version)) <= 0) continue;
+        if (!n) printf("Upgrade plan:\n");
+        printf(" %s %s -> %s\n", RS(r->name), DB_STR(rec->version), RS(r->version));
+        names[n++] = RS(r->name);
+        /* dependencies the new versions added */
+        for (uint32_t d = 0; d < r->ndeps; d++) {
+            if (resolve_visit(&g, RS(repo.dep[r->deps + d].name)) == -1) {
+                graph_free(&g); free(names); free(failed);
+                return 1;
+            }
+        }
+    }
+    if (!n) { printf("Everything is up to date\n"); graph_free(&g); free(names); free(failed); return 0; }
+    for (int k = 0; k < g.n; k++) printf(" %s (new dependency)\n", g.v[k].name);
+    if (txn_begin("upgrade")) { graph_free(&g); free(names); free(failed); return 1; }
+    int err = install_graph(&g);
+    graph_free(&g);
+    if (err) fprintf(stderr, "New dependencies failed to install, nothing upgraded\n");
+    else {
+        err = install_level(names, NULL, failed, n, 1);
+        printf("%d of %d packages upgraded\n", n - err, n);
+    }
+    if (txn_commit()) err = n;
+    free(names); free(failed);
+    return err;
+}
+
+int install_package(const char *package_name) {
+    if (is_installed(package_name)) { printf("%s is already installed\n", package_name); return 0; }
+    const char *names[1] = { package_name };
+    int failed;
+    if (txn_begin("install")) return -1;
+    int err = install_level(names, NULL, &failed, 1, 0);
+    return txn_commit() || err ? -1 : 0;
+}
+
+/* everything after the download: checks, unpack, DB record */
+static int install_from(struct archive *a, const char *package_name, int update, uint32_t flags, Stream *src) {
+    if (!a) return -1;
+    printf(update ? "Updating %s\n" : "Installing %s\n", package_name);
+    int deps = *PKG_ROOT ? 0 : UNPACK_DEPS;     /* see install_graph */
+    Package *pkg = unpack_package(a, package_name, deps | (update ? 0 : UNPACK_SHOW), src);
+    archive_read_close(a); archive_read_free(a);
+    if (!pkg) return -1;
+    /* an update or reinstall keeps the reason it was first installed for */
+    Package old;
+    pkg->flags = pkgdb_get(package_name, &old) ? old.flags & DB_AUTO : flags;
+    mark_installed(package_name, pkg);
+    log_action(update ? "update" : "install", package_name, 0);
+    printf(update ? "%s updated\n" : "%s installed\n", package_name);
+    free(pkg);
+    return 0;
+}
+
+static int install_downloaded(const char *package_name, int update, uint32_t flags) {
+    return install_from(open_cached(package_name), package_name, update, flags, NULL);
+}
+
+/* history/<gen>: the installed set after each transaction, sorted by
+   name, so two generations diff in one pass.
+     G <gen> <time> <op>
+     P <name>\t<version>\t<sha256 of its archive, - if unknown>\t<flags>
+   Archives kept in blobs/ by checksum are what rollback reinstalls
+   from; unpacking one writes that version's manifest back. flags is
+   DB_AUTO or 0, and 0 in generations written before it was recorded. */
+typedef struct {
+    char *name, *version, *sha256;
+    uint32_t flags;
+} GenPkg;
+
+typedef struct {
+    long gen;
+    long time;
+    char op[32];
+    GenPkg *p;
+    int n;
+    char *buf;
+} Generation;
+
+static long history_last(void) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, HISTORY_DIR);
+    DIR *d = opendir(path);
+    if (!d) return 0;
+    struct dirent *e;
+    long last = 0;
+    while ((e = readdir(d))) {
+        char *end;
+        long g = strtol(e->d_name, &end, 10);
+        if (!*end && g > last) last = g;
+    }
+    closedir(d);
+    return last;
+}
+
+static void gen_free(Generation *g) {
+    free(g->p); free(g->buf);
+    memset(g, 0, sizeof(*g));
+}
+
+static int gen_load(long gen, Generation *g) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s/%ld", PKG_DB_PATH, HISTORY_DIR, gen);
+    memset(g, 0, sizeof(*g));
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    struct stat st;
+    fstat(fileno(f), &st);
+    g->buf = malloc(st.st_size + 1);
+    size_t len = fread(g->buf, 1, st.st_size, f);
+    fclose(f);
+    g->buf[len] = 0;
+    int cap = 0;
+    for (char *line = g->buf, *next; *line; line = next) {
+        next = line + strcspn(line, "\n");
+        if (*next) *next++ = 0;
+        if (line[0] == 'G') { sscanf(line, "G %ld %ld %31s", &g->gen, &g->time, g->op); continue; }
+        char *ver = strchr(line, '\t'), *sha = ver ? strchr(ver + 1, '\t') : NULL;
+        if (line[0] != 'P' || !sha) continue;
+        *ver++ = 0; *sha++ = 0;
+        char *why = strchr(sha, '\t');
+        if (why) *why++ = 0;
+        if (g->n == cap) {
+            cap = cap ? cap * 2 : 256;
+            g->p = realloc(g->p, cap * sizeof(GenPkg));
+        }
+        g->p[g->n++] = (GenPkg){ line + 2, ver, sha, why ? strtoul(why, NULL, 10) & DB_AUTO : 0 };
+    }
+    if (g->gen != gen) { gen_free(g); return -1; }
+    return 0;
+}
+
+/* Write the next generation if the installed set or why anything in it
+   is installed changed. Unchanged packages keep the checksum the
+   previous generation knew; changed ones take the repo's if it lists
+   the version now installed. */
+static void history_record(const char *op) {
+    Generation prev;
+    long last = history_last();
+    int have = last && !gen_load(last, &prev), changed = !have, j = 0;
+    uint32_t count = db.hdr ? db.hdr->count : 0;
+    if (have && prev.n != (int)count) changed = 1;
+    char tmp[512], path[512];
+    snprintf(path, sizeof(path), "%s/%s/%ld", PKG_DB_PATH, HISTORY_DIR, last + 1);
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid());
+    FILE *f = fopen(tmp, "w");
+    if (!f) { if (have) gen_free(&prev); return; }
+    fprintf(f, "G %ld %ld %s\n", last + 1, (long)time(NULL), op);
+    for (uint32_t i = 0; i < count; i++) {
+        const char *name = DB_STR(db.rec[i].name), *ver = DB_STR(db.rec[i].version), *sha;
+        uint32_t why = db.rec[i].flags & DB_AUTO;
+        while (have && j < prev.n && strcmp(prev.p[j].name, name) < 0) j++;
+        if (have && j < prev.n && !strcmp(prev.p[j].name, name) && !strcmp(prev.p[j].version, ver)) {
+            sha = prev.p[j].sha256;
+            if (prev.p[j].flags != why) changed = 1;
+        } else {
+            const RepoEntry *r = repo_open() ? NULL : repo_find(name);
+            sha = r && r->sha256 && !strcmp(RS(r->version), ver) ? RS(r->sha256) : "-";
+            changed = 1;
+        }
+        fprintf(f, "P %s\t%s\t%s\t%u\n", name, ver, sha, why);
+    }
+    if (have) gen_free(&prev);
+    if (fclose(f) || !changed || rename(tmp, path)) unlink(tmp);
+}
+
+void list_generations(void) {
+    long last = history_last();
+    for (long g = 1; g <= last; g++) {
+        Generation gen;
+        if (gen_load(g, &gen)) continue;
+        char when[32];
+        time_t t = gen.time;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+        printf("%5ld  %s  %-10s %d packages%s\n", g, when, gen.op, gen.n, g == last ? "  (current)" : "");
+        gen_free(&gen);
+    }
+}
+
+/* Bring the installed set back to generation `gen` (default: the one
+   before the latest). Only packages that differ are touched: extras are
+   removed, the rest are unpacked from their cached archives, or fetched
+   if the repo still carries that exact version. Everything is checked
+   before anything changes, and the rollback is itself a generation. */
+int rollback(const char *gen) {
+    long last = history_last(), want = gen ? strtol(gen, NULL, 10) : last - 1;
+    Generation g;
+    if (want < 1 || gen_load(want, &g)) {
+        fprintf(stderr, last > 1 ? "No generation %ld\n" : "No earlier generation to roll back to\n", want);
+        return 1;
+    }
+    /* db is remapped by the removal, so everything is copied out */
+    char **drop = malloc((db.hdr ? db.hdr->count : 0) * sizeof(char *) + 1);
+    GenPkg **add = malloc(g.n * sizeof(GenPkg *) + 1), **retag = malloc(g.n * sizeof(GenPkg *) + 1);
+    int *update = malloc(g.n * sizeof(int) + 1);
+    char (*src)[512] = malloc(g.n * sizeof(*src) + 1);
+    int ndrop = 0, nadd = 0, nretag = 0, missing = 0, err = 0;
+    uint32_t i = 0, count = db.hdr ? db.hdr->count : 0;
+    for (int j = 0; i < count || j < g.n; ) {
+        int c = i >= count ? 1 : j >= g.n ? -1 : strcmp(DB_STR(db.rec[i].name), g.p[j].name);
+        if (c < 0) { drop[ndrop++] = strdup(DB_STR(db.rec[i++].name)); continue; }
+        if (c == 0 && !strcmp(DB_STR(db.rec[i].version), g.p[j].version)) {
+            if ((db.rec[i].flags & DB_AUTO) != g.p[j].flags) retag[nretag++] = &g.p[j];
+            i++; j++;
+            continue;
+        }
+        update[nadd] = c == 0;
+        if (c == 0) i++;
+        add[nadd++] = &g.p[j++];
+    }
+    for (int k = 0; k < nadd; k++) {
+        GenPkg *p = add[k];
+        struct stat st;
+        snprintf(src[k], sizeof(src[k]), "%s/blobs/%s", PKG_CACHE_PATH, p->sha256);
+        if (strcmp(p->sha256, "-") && !stat(src[k], &st)) continue;
+        const RepoEntry *r = repo_open() ? NULL : repo_find(p->name);
+        if (r && !strcmp(RS(r->version), p->version) && !download_package(p->name)) {
+            cache_path(p->name, src[k], sizeof(src[k]));
+            continue;
+        }
+        fprintf(stderr, "%s %s is neither cached nor in the repository\n", p->name, p->version);
+        missing++;
+    }
+    if (missing) err = 1;
+    else if (!ndrop && !nadd && !nretag) printf("Already at generation %ld\n", want);
+    else if (txn_begin("rollback")) err = 1;
+    else {
+        printf("Rolling back to generation %ld: %d to remove, %d to install\n", want, ndrop, nadd);
+        /* what stays may be mid-downgrade to versions that don't need these */
+        if (ndrop && remove_packages(ndrop, drop, REMOVE_FORCE)) err = 1;
+        for (int k = 0; k < nadd && !err; k++) {
+            struct archive *a = open_archive(src[k], add[k]->name);
+            if (!a) { err = 1; break; }
+            printf("%s %s %s\n", update[k] ? "Restoring" : "Installing", add[k]->name, add[k]->version);
+            /* the target set was consistent, so dependencies aren't rechecked */
+            Package *pkg = unpack_package(a, add[k]->name, 0, NULL);
+            archive_read_close(a); archive_read_free(a);
+            if (!pkg) { err = 1; break; }
+            pkg->flags = add[k]->flags;
+            mark_installed(add[k]->name, pkg);
+            log_action("rollback", add[k]->name, 0);
+            free(pkg);
+        }
+        /* the same version, installed for another reason back then */
+        for (int k = 0; k < nretag && !err; k++) {
+            Package p;
+            if (!pkgdb_get(retag[k]->name, &p)) continue;
+            p.flags = (p.flags & ~DB_AUTO) | retag[k]->flags;
+            pkgdb_put(&p);
+        }
+        if (txn_commit()) err = 1;
+    }
+    for (int k = 0; k < ndrop; k++) free(drop[k]);
+    free(drop); free(add); free(retag); free(update); free(src);
+    gen_free(&g);
+    if (err) fprintf(stderr, "Rollback to generation %ld failed\n", want);
+    return err;
+}
+
+typedef struct {
+    char *path;
+    const char *owner;
+} OwnedPath;
+
+/* order by directory, then name, so each directory is opened once */
+static int owned_cmp(const void *a, const void *b) {
+    const char *x = ((const OwnedPath *)a)->path, *y = ((const OwnedPath *)b)->path;
+    size_t dx = strrchr(x, '/') - x, dy = strrchr(y, '/') - y;
+    int c = memcmp(x, y, dx < dy ? dx : dy);
+    if (c || dx == dy) return c ? c : strcmp(x + dx, y + dx);
+    return dx < dy ? -1 : 1;
+}
+
+static int dir_depth_cmp(const void *a, const void *b) {
+    return strcmp(*(char * const *)b, *(char * const *)a);
+}
+
+/* Whatever installed still needs the doomed set, found through the
+   reverse edges of each package, so it costs their degree rather than a
+   pass over every depends=. REMOVE_CASCADE adds them (and what needs
+   them in turn) to the set; otherwise they refuse the removal. */
+static int remove_dependents(const char ***doomed, int *n, int how, PathList *extra) {
+    if (!db.hdr) return 0;
+    if (!db.rdep_off) { fprintf(stderr, "%s has no dependency graph yet\n", PKGDB_FILE); return -1; }
+    unsigned char *in = calloc(db.hdr->count + 1, 1);
+    uint32_t *queue = malloc((db.hdr->count + 1) * sizeof(uint32_t)), nq = 0;
+    for (int i = 0; i < *n; i++) {
+        const DbRecord *r = pkgdb_lookup((*doomed)[i]);
+        if (r && !in[r - db.rec]) { in[r - db.rec] = 1; queue[nq++] = r - db.rec; }
+    }
+    int blocked = 0;
+    for (uint32_t q = 0; q < nq; q++) {
+        uint32_t k = queue[q], first = 1;
+        for (uint32_t e = db.rdep_off[k]; e < db.rdep_off[k + 1]; e++) {
+            uint32_t d = db.rdep[e];
+            if (in[d]) continue;
+            if (how == REMOVE_CASCADE) {
+                in[d] = 1;
+                queue[nq++] = d;
+                path_list_add(extra, DB_STR(db.rec[d].name));
+                continue;
+            }
+            if (first) fprintf(stderr, "%s is needed by", DB_STR(db.rec[k].name));
+            fprintf(stderr, " %s", DB_STR(db.rec[d].name));
+            first = 0; blocked = 1;
+        }
+        if (!first) fputc('\n', stderr);
+    }
+    free(in); free(queue);
+    if (blocked) { fprintf(stderr, "Nothing removed; remove --cascade takes those along\n"); return -1; }
+    if (!extra->n) return 0;
+    *doomed = realloc(*doomed, (*n + extra->n + 1) * sizeof(char *));
+    printf("Also removing what needs them:");
+    for (int i = 0; i < extra->n; i++) { printf(" %s", extra->v[i]); (*doomed)[(*n)++] = extra->v[i]; }
+    printf("\n");
+    return 0;
+}
+
+/* nothing but . and .. in it */
+static int dir_empty(const char *path) {
+    DIR *d = opendir(path);
+    if (!d) return 0;
+    struct dirent *e;
+    int n = 0;
+    while (!n && (e = readdir(d))) n = strcmp(e->d_name, ".") && strcmp(e->d_name, "..");
+    closedir(d);
+    return !n;
+}
+
+/* directory entries of every installed package outside doomed, sorted */
+static void listed_dirs(const char **doomed, int n, PathList *out) {
+    char line[MANIFEST_LINE], path[512];
+    for (uint32_t k = 0; db.hdr && k < db.hdr->count; k++) {
+        const char *name = DB_STR(db.rec[k].name);
+        int gone = 0;
+        for (int i = 0; i < n && !gone; i++) gone = !strcmp(name, doomed[i]);
+        if (gone) continue;
+        snprintf(path, sizeof(path), "%s/%s.files", PKG_DB_PATH, name);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        while (manifest_next(f, line, NULL)) if (is_dir_entry(line)) path_list_add(out, line);
+        fclose(f);
+    }
+    qsort(out->v, out->n, sizeof(char *), path_cmp);
+}
+
+/* Remove several packages as one transaction: every file of every
+   package is unlinked relative to a cached fd of its directory, then
+   the directories they leave empty are pruned, deepest first: the ones
+   the packages created and every parent of a removed file, unless
+   another package lists it. */
+int remove_packages(int count, char *names[], int how) {
+    const char **doomed = malloc((count + 1) * sizeof(char *));
+    PathList extra = {0};
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (!is_installed(names[i])) printf("%s ain't installed?\n", names[i]);
+        else doomed[n++] = names[i];
+    }
+    if (!n) { free(doomed); return 0; }
+    if ((how != REMOVE_FORCE && remove_dependents(&doomed, &n, how, &extra)) || txn_begin("remove")) {
+        free(doomed);
+        path_list_free(&extra);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) journal_write("X %s\n", doomed[i]);
+    printf("Nuking");
+    for (int i = 0; i < n; i++) printf(" %s", doomed[i]);
+    printf("\n");
+    OwnedPath *files = NULL;
+    int nfiles = 0, cap = 0;
+    PathList dirs = {0};
+    char line[MANIFEST_LINE], path[512];
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%s.files", PKG_DB_PATH, doomed[i]);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        while (manifest_next(f, line, NULL)) {
+            if (is_dir_entry(line)) { path_list_add(&dirs, line); continue; }
+            if (nfiles == cap) {
+                cap = cap ? cap * 2 : 1024;
+                files = realloc(files, cap * sizeof(OwnedPath));
+            }
+            files[nfiles].path = strdup(line);
+            files[nfiles++].owner = doomed[i];
+        }
+        fclose(f);
+    }
+    qsort(files, nfiles, sizeof(OwnedPath), owned_cmp);
+    int have_idx = !pathidx_open(), ok = 0, fail = 0, pruned = 0, dfd = -1;
+    size_t dlen = 0;
+    const char *dir = NULL;
+    for (int i = 0; i < nfiles; i++) {
+        char *p = files[i].path, *slash = strrchr(p, '/');
+        if (!dir || (size_t)(slash - p) != dlen || strncmp(p, dir, dlen)) {
+            if (dfd >= 0) close(dfd);
+            dir = p; dlen = slash - p;
+            /* with the slash kept, root_path resolves the whole directory */
+            char d[1024];
+            snprintf(d, sizeof(d), "%.*s", (int)dlen + 1, p);
+            const char *dp = root_path(d, path, sizeof(path));
+            dfd = dp ? open(dp, O_RDONLY|O_DIRECTORY) : -1;
+        }
+        if (dir == p) {
+            /* a new directory: it and its parents may be left empty */
+            char d[1024];
+            size_t len = snprintf(d, sizeof(d), "%.*s", (int)dlen + 1, p);
+            while (len > 1 && len < sizeof(d)) {
+                path_list_add(&dirs, d);
+                for (d[--len] = 0; len && d[len - 1] != '/'; d[--len] = 0);
+            }
+        }
+        if (PKG_VERBOSE) printf(" Deleting: %s\n", p);
+        dfd >= 0 && !unlinkat(dfd, slash + 1, 0) ? ok++ : fail++;
+        if (have_idx) pathidx_clear(p, files[i].owner);
+    }
+    if (dfd >= 0) close(dfd);
+    qsort(dirs.v, dirs.n, sizeof(char *), dir_depth_cmp);
+    PathList kept = {0};
+    int have_kept = 0;
+    for (int i = 0; i < dirs.n; i++) {
+        if (i && !strcmp(dirs.v[i], dirs.v[i - 1])) continue;
+        const char *dp = root_path(dirs.v[i], path, sizeof(path));
+        if (!dp || !dir_empty(dp)) continue;
+        /* only read the other manifests once something could go */
+        if (!have_kept) { listed_dirs(doomed, n, &kept); have_kept = 1; }
+        if (bsearch(&dirs.v[i], kept.v, kept.n, sizeof(char *), path_cmp)) continue;
+        if (PKG_VERBOSE) printf(" Pruning: %s\n", dirs.v[i]);
+        if (!rmdir(dp)) pruned++;
+    }
+    path_list_free(&kept);
+    pathidx_sync();
+    printf("Cleanup: %d files trashed, %d failed, %d directories pruned\n", ok, fail, pruned);
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%s.files", PKG_DB_PATH, doomed[i]);
+        unlink(path);
+        pkgdb_del(doomed[i]);
+    }
+    int err = txn_commit();
+    for (int i = 0; i < n; i++) {
+        log_action("remove", doomed[i], err);
+        if (!err) printf("%s is gone, baby, gone\n", doomed[i]);
+    }
+    for (int i = 0; i < nfiles; i++) free(files[i].path);
+    free(files); free(doomed);
+    path_list_free(&dirs);
+    path_list_free(&extra);
+    return err ? -1 : 0;
+}
+
+/* mark whatever the marked records depend on, transitively: one pass
+   over the depends edges, O(V+E) */
+static void pkgdb_reach(unsigned char *keep) {
+    uint32_t n = db.hdr->count, top = 0, *stack = malloc((n + 1) * sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) if (keep[i]) stack[top++] = i;
+    while (top) {
+        uint32_t k = stack[--top];
+        for (uint32_t e = db.dep_off[k]; e < db.dep_off[k + 1]; e++)
+            if (!keep[db.dep[e]]) { keep[db.dep[e]] = 1; stack[top++] = db.dep[e]; }
+    }
+    free(stack);
+}
+
+/* remove everything left unmarked; nothing marked can need it */
+static int remove_unmarked(const unsigned char *keep, int *removed) {
+    /* removing remaps the database, so copy the names out first */
+    uint32_t total = db.hdr->count;
+    char **names = malloc((total + 1) * sizeof(char *));
+    int n = 0;
+    for (uint32_t i = 0; i < total; i++) if (!keep[i]) names[n++] = strdup(DB_STR(db.rec[i].name));
+    int err = n ? remove_packages(n, names, REMOVE_CHECK) : 0;
+    for (int i = 0; i < n; i++) free(names[i]);
+    free(names);
+    *removed = n;
+    return err;
+}
+
+/* Orphans: packages installed as dependencies that nothing explicit
+   still reaches, cycles among them included. */
+int autoremove(void) {
+    if (!db.hdr) { printf("No orphans\n"); return 0; }
+    if (!db.dep_off) { fprintf(stderr, "%s has no dependency graph yet\n", PKGDB_FILE); return 1; }
+    unsigned char *keep = calloc(db.hdr->count + 1, 1);
+    for (uint32_t i = 0; i < db.hdr->count; i++) keep[i] = !(db.rec[i].flags & DB_AUTO);
+    pkgdb_reach(keep);
+    int n, err = remove_unmarked(keep, &n);
+    free(keep);
+    if (!n) printf("No orphans\n");
+    return err ? 1 : 0;
+}
+
+int remove_package(const char *package_name) {
+    char *names[1] = { (char *)package_name };
+    return remove_packages(1, names, REMOVE_FORCE);
+}
+
+/* search.idx: trigram index over the names and descriptions of installed
+   (packages.db) and available (repo.idx) packages. Documents are record
+   numbers, with SEARCH_REPO set for repo entries; each trigram maps to a
+   sorted run of them. The header stamps both sources so a stale index is
+   rebuilt on the next search. */
+#define SEARCHIDX_FILE "search.idx"
+#define SEARCHIDX_MAGIC "MPKGSIX1"
+#define SEARCH_REPO 0x80000000u
+#define SEARCH_TERMS 16
+
+typedef struct {
+    uint64_t ino, size;
+    int64_t mtime;      /* ns */
+} FileStamp;
+
+typedef struct {
+    char magic[8];
+    uint32_t ngrams, pad;
+    FileStamp db, repo;
+    uint64_t grams, postings, npostings;
+} SearchHeader;
+
+typedef struct {
+    uint32_t gram;      /* three lowercased bytes */
+    uint32_t n;
+    uint64_t off;       /* into the postings */
+} SearchGram;
+
+static struct {
+    void *map;
+    size_t len;
+    const SearchHeader *hdr;
+    const SearchGram *gram;
+    const uint32_t *post;
+} sidx;
+
+static void file_stamp(const char *name, FileStamp *fs) {
+    char path[512];
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, name);
+    memset(fs, 0, sizeof(*fs));
+    if (stat(path, &st)) return;
+    fs->ino = st.st_ino;
+    fs->size = st.st_size;
+    fs->mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+}
+
+static uint32_t trigram(const char *s) {
+    return (uint32_t)(unsigned char)tolower((unsigned char)s[0]) << 16 |
+           (uint32_t)(unsigned char)tolower((unsigned char)s[1]) << 8 |
+           (unsigned char)tolower((unsigned char)s[2]);
+}
+
+static void doc_text(uint32_t doc, const char **name, const char **version, const char **desc) {
+    if (doc & SEARCH_REPO) {
+        const RepoEntry *e = &repo.ent[doc & ~SEARCH_REPO];
+        *name = RS(e->name); *version = RS(e->version); *desc = RS(e->description);
+    } else {
+        const DbRecord *r = &db.rec[doc];
+        *name = DB_STR(r->name); *version = DB_STR(r->version); *desc = DB_STR(r->description);
+    }
+}
+
+static void gram_add(uint64_t **v, size_t *n, size_t *cap, const char *s, uint32_t doc) {
+    for (size_t len = strlen(s), i = 0; i + 3 <= len; i++) {
+        if (*n == *cap) {
+            *cap = *cap ? *cap * 2 : 65536;
+            *v = realloc(*v, *cap * sizeof(uint64_t));
+        }
+        (*v)[(*n)++] = (uint64_t)trigram(s + i) << 32 | doc;
+    }
+}
+
+static int u64_cmp(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int search_map(void) {
+    char path[512];
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, SEARCHIDX_FILE);
+    if (sidx.map) munmap(sidx.map, sidx.len);
+    memset(&sidx, 0, sizeof(sidx));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return 1;
+    struct stat st;
+    if (fstat(fd, &st) || (size_t)st.st_size < sizeof(SearchHeader)) { close(fd); return 1; }
+    void *m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) return -1;
+    const SearchHeader *h = m;
+    if (memcmp(h->magic, SEARCHIDX_MAGIC, 8) ||
+        h->postings + h->npostings * sizeof(uint32_t) > (uint64_t)st.st_size) {
+        munmap(m, st.st_size);
+        return 1;
+    }
+    sidx.map = m; sidx.len = st.st_size; sidx.hdr = h;
+    sidx.gram = (const SearchGram *)((const char *)m + h->grams);
+    sidx.post = (const uint32_t *)((const char *)m + h->postings);
+    return 0;
+}
+
+/* Index every name and description. Called after sync, and by search
+   when packages.db or repo.idx has changed since. */
+int search_build(void) {
+    if (repo_open() < 0) return -1;
+    char path[512], tmp[600];
+    snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, SEARCHIDX_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    uint64_t *v = NULL;
+    size_t n = 0, cap = 0;
+    for (uint32_t i = 0; db.hdr && i < db.hdr->count; i++) {
+        gram_add(&v, &n, &cap, DB_STR(db.rec[i].name), i);
+        gram_add(&v, &n, &cap, DB_STR(db.rec[i].description), i);
+    }
+    for (uint32_t i = 0; repo.hdr && i < repo.hdr->count; i++) {
+        gram_add(&v, &n, &cap, RS(repo.ent[i].name), i | SEARCH_REPO);
+        gram_add(&v, &n, &cap, RS(repo.ent[i].description), i | SEARCH_REPO);
+    }
+    qsort(v, n, sizeof(uint64_t), u64_cmp);
+    SearchGram *grams = malloc((n + 1) * sizeof(SearchGram));
+    uint32_t *post = malloc((n + 1) * sizeof(uint32_t));
+    uint32_t ngrams = 0;
+    uint64_t np = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i && v[i] == v[i-1]) continue;
+        uint32_t g = v[i] >> 32;
+        if (!ngrams || grams[ngrams-1].gram != g) grams[ngrams++] = (SearchGram){ g, 0, np };
+        grams[ngrams-1].n++;
+        post[np++] = (uint32_t)v[i];
+    }
+    free(v);
+
+    SearchHeader h = {0};
+    memcpy(h.magic, SEARCHIDX_MAGIC, 8);
+    h.ngrams = ngrams;
+    file_stamp(PKGDB_FILE, &h.db);
+    file_stamp(REPOIDX_FILE, &h.repo);
+    h.grams = sizeof(h);
+    h.postings = h.grams + (uint64_t)ngrams * sizeof(SearchGram);
+    h.npostings = np;
+    FILE *f = fopen(tmp, "w");
+    int err = !f;
+    if (f) {
+        err = fwrite(&h, sizeof(h), 1, f) != 1 ||
+              fwrite(grams, sizeof(SearchGram), ngrams, f) != ngrams ||
+              fwrite(post, sizeof(uint32_t), np, f) != np;
+        err |= fclose(f) != 0;
+        if (!err) err = rename(tmp, path) != 0;
+        if (err) unlink(tmp);
+    }
+    free(grams); free(post);
+    return err ? -1 : search_map();
+}
+
+static int search_current(const FileStamp *d, const FileStamp *r) {
+    return sidx.hdr && !memcmp(&sidx.hdr->db, d, sizeof(*d)) && !memcmp(&sidx.hdr->repo, r, sizeof(*r));
+}
+
+/* map search.idx, rebuilding it if either source changed; -1 if there
+   is no usable index (e.g. a read-only PKG_DB_PATH) */
+static int search_open(void) {
+    if (repo_open() < 0) return -1;
+    FileStamp d, r;
+    file_stamp(PKGDB_FILE, &d);
+    file_stamp(REPOIDX_FILE, &r);
+    if (search_current(&d, &r)) return 0;
+    if (search_map() >= 0 && search_current(&d, &r)) return 0;
+    if (!search_build()) return 0;
+    /* a stale index would hide packages; scan everything instead */
+    if (sidx.map) munmap(sidx.map, sidx.len);
+    memset(&sidx, 0, sizeof(sidx));
+    return -1;
+}
+
+static const SearchGram* search_gram(uint32_t g) {
+    uint32_t lo = 0, hi = sidx.hdr->ngrams;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (sidx.gram[mid].gram < g) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < sidx.hdr->ngrams && sidx.gram[lo].gram == g ? &sidx.gram[lo] : NULL;
+}
+
+/* keep the docs in v[0..n) that are also in the posting run of g */
+static size_t search_intersect(uint32_t *v, size_t n, const SearchGram *g) {
+    if (!g) return 0;
+    const uint32_t *p = sidx.post + g->off;
+    size_t out = 0, j = 0;
+    for (size_t i = 0; i < n && j < g->n; ) {
+        if (v[i] < p[j]) i++;
+        else if (v[i] > p[j]) j++;
+        else { v[out++] = v[i++]; j++; }
+    }
+    return out;
+}
+
+/* optimal string alignment distance, giving up past max */
+static int edit_distance(const char *a, size_t la, const char *b, size_t lb, int max) {
+    if (la > 63 || lb > 63 || (la > lb ? la - lb : lb - la) > (size_t)max) return max + 1;
+    int d[64][64];
+    for (size_t i = 0; i <= la; i++) d[i][0] = i;
+    for (size_t j = 0; j <= lb; j++) d[0][j] = j;
+    for (size_t i = 1; i <= la; i++) {
+        int best = max + 1;
+        for (size_t j = 1; j <= lb; j++) {
+            int c = tolower((unsigned char)a[i-1]) != tolower((unsigned char)b[j-1]);
+            int x = d[i-1][j-1] + c;
+            if (d[i-1][j] + 1 < x) x = d[i-1][j] + 1;
+            if (d[i][j-1] + 1 < x) x = d[i][j-1] + 1;
+            if (i > 1 && j > 1 && c && tolower((unsigned char)a[i-1]) == tolower((unsigned char)b[j-2]) &&
+                tolower((unsigned char)a[i-2]) == tolower((unsigned char)b[j-1]) && d[i-2][j-2] + 1 < x)
+                x = d[i-2][j-2] + 1;
+            d[i][j] = x;
+            if (x < best) best = x;
+        }
+        if (best > max) return max + 1;
+    }
+    return d[la][lb];
+}
+
+/* closest word of s to t, split on anything but letters and digits */
+static int word_distance(const char *s, const char *t, int max) {
+    size_t lt = strlen(t);
+    int best = max + 1;
+    while (*s) {
+        while (*s && !isalnum((unsigned char)*s)) s++;
+        const char *w = s;
+        while (isalnum((unsigned char)*s)) s++;
+        if (s > w) {
+            int d = edit_distance(w, s - w, t, lt, max);
+            if (d < best) best = d;
+        }
+    }
+    return best;
+}
+
+/* how well one term matches a package, 0 if it doesn't */
+static int term_score(const char *name, const char *desc, const char *t, int fuzzy) {
+    size_t lt = strlen(t);
+    if (!strcasecmp(name, t)) return 100;
+    if (!strncasecmp(name, t, lt)) return 60;
+    if (strcasestr(name, t)) return 40;
+    const char *p = strcasestr(desc, t);
+    if (p) return p == desc || !isalnum((unsigned char)p[-1]) ? 20 : 10;
+    if (!fuzzy || lt < 3) return 0;
+    int max = lt <= 4 ? 1 : 2, d;
+    if ((d = edit_distance(name, strlen(name), t, lt, max)) <= max) return 36 - 8 * d;
+    if ((d = word_distance(name, t, max)) <= max) return 30 - 8 * d;
+    if ((d = word_distance(desc, t, max)) <= max) return 8 - 2 * d;
+    return 0;
+}
+
+typedef struct {
+    uint32_t doc;
+    int score;
+} SearchHit;
+
+static int hit_cmp(const void *a, const void *b) {
+    const SearchHit *x = a, *y = b;
+    if (x->score != y->score) return y->score - x->score;
+    if ((x->doc & SEARCH_REPO) != (y->doc & SEARCH_REPO)) return x->doc & SEARCH_REPO ? 1 : -1;
+    const char *nx, *ny, *v, *d;
+    doc_text(x->doc, &nx, &v, &d);
+    doc_text(y->doc, &ny, &v, &d);
+    size_t lx = strlen(nx), ly = strlen(ny);
+    return lx != ly ? (lx < ly ? -1 : 1) : strcmp(nx, ny);
+}
+
+/* Candidates for the terms: exact ones must contain every trigram of
+   every term; fuzzy ones enough to be within a few edits. Short terms
+   don't narrow anything down. */
+static size_t search_candidates(char **terms, int nterms, int fuzzy, uint32_t **out) {
+    size_t ndb = db.hdr ? db.hdr->count : 0, nrepo = repo.hdr ? repo.hdr->count : 0;
+    uint32_t *v = malloc((ndb + nrepo + 1) * sizeof(uint32_t));
+    size_t n = 0;
+    for (size_t i = 0; i < ndb; i++) v[n++] = i;
+    for (size_t i = 0; i < nrepo; i++) v[n++] = i | SEARCH_REPO;
+    if (!sidx.hdr) { *out = v; return n; }
+    for (int t = 0; t < nterms && n; t++) {
+        size_t lt = strlen(terms[t]);
+        if (lt < 3) continue;
+        if (!fuzzy) {
+            for (size_t i = 0; i + 3 <= lt && n; i++) n = search_intersect(v, n, search_gram(trigram(terms[t] + i)));
+            continue;
+        }
+        /* each edit breaks at most three trigrams, so a match within
+           max edits still shares need of them */
+        int max = lt <= 4 ? 1 : 2, need = (int)lt - 2 - 3 * max;
+        if (need < 1) continue;
+        unsigned char *keep = calloc(n, 1);
+        for (size_t i = 0; i + 3 <= lt; i++) {
+            const SearchGram *g = search_gram(trigram(terms[t] + i));
+            if (!g) continue;
+            const uint32_t *p = sidx.post + g->off;
+            for (size_t a = 0, b = 0; a < n && b < g->n; ) {
+                if (v[a] < p[b]) a++;
+                else if (v[a] > p[b]) b++;
+                else { if (keep[a] < 255) keep[a]++; a++; b++; }
+            }
+        }
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++) if (keep[i] >= need) v[m++] = v[i];
+        free(keep);
+        n = m;
+    }
+    *out = v;
+    return n;
+}
+
+/* Every term must match; names beat descriptions, exact beats fuzzy.
+   Close matches are only tried when nothing matches exactly, and then
+   *fuzzy is set. Returns the hits, best first, to free(). */
+static SearchHit* search_run(const char *query, size_t *count, int *fuzzy) {
+    char q[512], *terms[SEARCH_TERMS], *save;
+    int nterms = 0;
+    snprintf(q, sizeof(q), "%s", query);
+    for (char *t = strtok_r(q, " \t", &save); t && nterms < SEARCH_TERMS; t = strtok_r(NULL, " \t", &save))
+        terms[nterms++] = t;
+    *count = 0; *fuzzy = 0;
+    if (!nterms) return NULL;
+    search_open();
+    SearchHit *hits = NULL;
+    size_t nhits = 0;
+    for (int near = 0; near < 2 && !nhits; near++) {
+        uint32_t *v;
+        size_t n = search_candidates(terms, nterms, near, &v);
+        hits = realloc(hits, (n + 1) * sizeof(SearchHit));
+        for (size_t i = 0; i < n; i++) {
+            const char *name, *version, *desc;
+            doc_text(v[i], &name, &version, &desc);
+            int score = 0, t;
+            for (t = 0; t < nterms; t++) {
+                int s = term_score(name, desc, terms[t], near);
+                if (!s) break;
+                score += s;
+            }
+            if (t == nterms) hits[nhits++] = (SearchHit){ v[i], score };
+        }
+        free(v);
+        *fuzzy = near;
+    }
+    qsort(hits, nhits, sizeof(SearchHit), hit_cmp);
+    *count = nhits;
+    return hits;
+}
+
+/* 6. ghost */
+int ghost_install(const char *package_name) {
+    if (download_package(package_name)) return -1;
+    struct archive *a = open_cached(package_name);
+    if (!a) return -1;
+    Package *pkg = unpack_package(a, package_name, UNPACK_DEPS, NULL);
+    archive_read_close(a); archive_read_free(a);
+    if (!pkg) return -1;
+    printf("%s ghost-installed (no DB entry)\n", package_name);
+    free(pkg);
+    return 0;
+}
+
+/* 7. self-update */
+int self_update(void) {
+    if (download_package("mpkg")) return -1;
+    char cache[512];
+    cache_path("mpkg", cache, sizeof(cache));
+    Package *p = read_package_info(cache);
+    if (!p) return -1;
+    char cmd[1024];
+    snprintf(cmd, sizeof(cmd), "cp %s /bin/mpkg && chmod 755 /bin/mpkg", cache);
+    if (system(cmd)) { free(p); return -1; }
+    printf("mpkg updated to %s\n", p->version);
+    free(p);
+    return 0;
+}
+
+/* 8. stats */
+void show_stats(void) {
+    int pkgs = 0; size_t total = 0;
+    struct { const char *name; size_t sz; } top[5] = {0};
+    for (uint32_t n = 0; db.hdr && n < db.hdr->count; n++) {
+        const DbRecord *r = &db.rec[n];
+        pkgs++; total += r->size;
+        for (int i = 0; i < 5; i++) {
+            if (r->size > top[i].sz) {
+                memmove(&top[i+1], &top[i], (4-i)*sizeof(top[0]));
+                top[i].name = DB_STR(r->name);
+                top[i].sz = r->size;
+                break;
+            }
+        }
+    }
+    printf("Packages: %d\nTotal size: %zu bytes\nTop 5 by size:\n", pkgs, total);
+    for (int i = 0; i < 5 && top[i].sz; i++) printf(" %s: %zu\n", top[i].name, top[i].sz);
+}
+
+/* 9. clean --aggressive: down to mpkg and busybox, and whatever they
+   need to keep working */
+int clean_aggressive(void) {
+    if (!db.hdr) return -1;
+    if (!db.dep_off) { fprintf(stderr, "%s has no dependency graph yet\n", PKGDB_FILE); return -1; }
+    unsigned char *keep = calloc(db.hdr->count + 1, 1);
+    static const char *core[] = { "mpkg", "busybox" };
+    for (int i = 0; i < 2; i++) {
+        const DbRecord *r = pkgdb_lookup(core[i]);
+        if (r) keep[r - db.rec] = 1;
+    }
+    pkgdb_reach(keep);
+    int n, err = remove_unmarked(keep, &n);
+    free(keep);
+    if (err) return -1;
+    printf("Aggressive clean complete\n");
+    return 0;
+}
+
+/* 10. doctor */
+#define DOCTOR_BATCH 256
+#define DOCTOR_QUEUE 64
+
+/* The main thread reads the manifests and queues them in batches; the
+   workers lstat each file and hash it only when size or mtime no
+   longer match what extraction recorded. */
+typedef struct {
+    char *owner;
+    char *lines[DOCTOR_BATCH];
+    int n;
+} DoctorBatch;
+
+static struct {
+    DoctorBatch *q[DOCTOR_QUEUE];
+    int head, len, done;
+    unsigned long checked, missing, modified, hashed;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} doc = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static int sha256_file(const char *path, char *hex) {
+    static __thread char buf[1 << 18];
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+    ssize_t n = -1;
+    if (md && EVP_DigestInit_ex(md, EVP_sha256(), NULL))
+        while ((n = read(fd, buf, sizeof(buf))) > 0) EVP_DigestUpdate(md, buf, n);
+    close(fd);
+    if (!n) digest_hex(md, hex);
+    EVP_MD_CTX_free(md);
+    return n ? -1 : 0;
+}
+
+static void doctor_report(const char *what, const char *path, const char *owner) {
+    pthread_mutex_lock(&doc.lock);
+    printf("%s: %s (owned by %s)\n", what, path, owner);
+    pthread_mutex_unlock(&doc.lock);
+}
+
+static void doctor_batch(DoctorBatch *b) {
+    unsigned long missing = 0, modified = 0, hashed = 0;
+    for (int i = 0; i < b->n; i++) {
+        FileMeta m;
+        struct stat st;
+        manifest_split(b->lines[i], &m);
+        char rp[1280];
+        const char *dp = root_path(m.path, rp, sizeof(rp));
+        if (!dp || lstat(dp, &st)) { doctor_report("Missing file", m.path, b->owner); missing++; continue; }
+        if (!m.sha256) continue;
+        int bad = !S_ISREG(st.st_mode) || (uint64_t)st.st_size != m.size;
+        if (!bad && st.st_mtime != m.mtime) {
+            char hex[2 * EVP_MAX_MD_SIZE + 1];
+            hashed++;
+            bad = sha256_file(dp, hex) || strcmp(hex, m.sha256);
+        }
+        if (bad) { doctor_report("Modified file", m.path, b->owner); modified++; }
+        else if ((st.st_mode & 07777) != m.mode) { doctor_report("Mode changed", m.path, b->owner); modified++; }
+    }
+    pthread_mutex_lock(&doc.lock);
+    doc.checked += b->n; doc.missing += missing; doc.modified += modified; doc.hashed += hashed;
+    pthread_mutex_unlock(&doc.lock);
+    for (int i = 0; i < b->n; i++) free(b->lines[i]);
+    free(b->owner); free(b);
+}
+
+static void* doctor_worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&doc.lock);
+        while (!doc.len && !doc.done) pthread_cond_wait(&doc.cond, &doc.lock);
+        if (!doc.len) { pthread_mutex_unlock(&doc.lock); return NULL; }
+        DoctorBatch *b = doc.q[doc.head];
+        doc.head = (doc.head + 1) % DOCTOR_QUEUE;
+        doc.len--;
+        pthread_cond_broadcast(&doc.cond);
+        pthread_mutex_unlock(&doc.lock);
+        doctor_batch(b);
+    }
+}
+
+static void doctor_queue(DoctorBatch *b) {
+    pthread_mutex_lock(&doc.lock);
+    while (doc.len == DOCTOR_QUEUE) pthread_cond_wait(&doc.cond, &doc.lock);
+    doc.q[(doc.head + doc.len++) % DOCTOR_QUEUE] = b;
+    pthread_cond_broadcast(&doc.cond);
+    pthread_mutex_unlock(&doc.lock);
+}
+
+void run_doctor(void) {
+    printf("Running mpkg doctor...\n");
+    DIR *d = opendir(PKG_DB_PATH);
+    if (!d) return;
+    /* stat-bound, so more threads than cores still pays */
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int nw = ncpu < 1 ? 2 : ncpu > 32 ? 64 : ncpu * 2;
+    pthread_t *tids = malloc(nw * sizeof(pthread_t));
+    for (int w = 0; w < nw; w++) pthread_create(&tids[w], NULL, doctor_worker, NULL);
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        char *suf = strstr(e->d_name, ".files");
+        if (!suf || suf[6]) continue;
+        char name[256], path[512], line[MANIFEST_LINE];
+        snprintf(name, sizeof(name), "%.*s", (int)(suf - e->d_name), e->d_name);
+        snprintf(path, sizeof(path), "%s/%s", PKG_DB_PATH, e->d_name);
+        FILE *f = fopen(path, "r");
+        if (!f) continue;
+        DoctorBatch *b = NULL;
+        while (fgets(line, sizeof(line), f)) {
+            line[strcspn(line, "\n")] = 0;
+            if (!*line || is_dir_entry(line)) continue;
+            if (!b) { b = calloc(1, sizeof(DoctorBatch)); b->owner = strdup(name); }
+            b->lines[b->n++] = strdup(line);
+            if (b->n == DOCTOR_BATCH) { doctor_queue(b); b = NULL; }
+        }
+        if (b) doctor_queue(b);
+        fclose(f);
+    }
+    closedir(d);
+    pthread_mutex_lock(&doc.lock);
+    doc.done = 1;
+    pthread_cond_broadcast(&doc.cond);
+    pthread_mutex_unlock(&doc.lock);
+    for (int w = 0; w < nw; w++) pthread_join(tids[w], NULL);
+    free(tids);
+    printf("Checked %lu files: %lu missing, %lu modified (%lu hashed)\n",
+           doc.checked, doc.missing, doc.modified, doc.hashed);
+    printf("Doctor finished\n");
+}
+
+/* mpkgd: keeps packages.db, repo.idx, search.idx and paths.idx mapped
+   and answers queries on a Unix socket in PKG_DB_PATH, remapping
+   whatever inotify sees replaced. The CLI passes in what a query runs
+   (its own list, info, search and owns), with FILEs for its output. A
+   request is the command's arguments, each NUL terminated; the reply
+   is "<status> <stdout bytes> <stderr bytes>\n" followed by both outputs. Each client is served on its own thread and
+   has DAEMON_DEADLINE to send its request and take the reply, so a slow
+   one holds up nobody else; queries themselves run one at a time. */
+#define DAEMON_SOCKET "mpkgd.sock"
+#define DAEMON_MAX_ARGS 64
+#define DAEMON_DEADLINE 5.0     /* seconds */
+
+static volatile sig_atomic_t daemon_stop;
+static int (*daemon_answer)(int argc, char *argv[], FILE *out, FILE *err);
+/* the maps: a query reads them, daemon_reload replaces them */
+static pthread_mutex_t daemon_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void daemon_signal(int sig) { (void)sig; daemon_stop = 1; }
+
+/* -1 with ENAMETOOLONG if the path doesn't fit in sun_path */
+static int daemon_addr(struct sockaddr_un *sa) {
+    memset(sa, 0, sizeof(*sa));
+    sa->sun_family = AF_UNIX;
+    if (snprintf(sa->sun_path, sizeof(sa->sun_path), "%s/%s", PKG_DB_PATH, DAEMON_SOCKET) >= (int)sizeof(sa->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+static int daemon_connect(void) {
+    struct sockaddr_un sa;
+    if (daemon_addr(&sa)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa))) { close(fd); return -1; }
+    return fd;
+}
+
+static int write_all(int fd, const char *buf, size_t n) {
+    while (n) {
+        ssize_t w = write(fd, buf, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return -1;
+        buf += w; n -= w;
+    }
+    return 0;
+}
+
+/* ask a running mpkgd; 0 if it answered, with the command's status */
+int daemon_query(int argc, char *argv[], int *status) {
+    int fd = daemon_connect();
+    if (fd < 0) return -1;
+    int err = 0;
+    for (int i = 0; i < argc && !err; i++) err = write_all(fd, argv[i], strlen(argv[i]) + 1);
+    shutdown(fd, SHUT_WR);
+    FILE *f = fdopen(fd, "r");
+    size_t no, ne;
+    if (err || !f || fscanf(f, "%d %zu %zu", status, &no, &ne) != 3 || fgetc(f) != '\n') {
+        if (f) fclose(f); else close(fd);
+        return -1;
+    }
+    char buf[65536];
+    for (int k = 0; k < 2; k++) {
+        size_t left = k ? ne : no;
+        while (left) {
+            size_t n = fread(buf, 1, left < sizeof(buf) ? left : sizeof(buf), f);
+            if (!n) break;
+            fwrite(buf, 1, n, k ? stderr : stdout);
+            left -= n;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/* wait for fd to be ready for ev until the deadline; nonzero if it passed */
+static int daemon_wait(int fd, short ev, double deadline) {
+    int ms = (deadline - clock_sec(CLOCK_MONOTONIC)) * 1000;
+    struct pollfd pf = { fd, ev, 0 };
+    return ms <= 0 || poll(&pf, 1, ms) <= 0;
+}
+
+/* write_all on a nonblocking socket, giving up at the deadline */
+static int daemon_send(int fd, const char *buf, size_t n, double deadline) {
+    while (n) {
+        ssize_t w = write(fd, buf, n);
+        if (w < 0 && (errno == EAGAIN || errno == EINTR)) {
+            if (daemon_wait(fd, POLLOUT, deadline)) return -1;
+            continue;
+        }
+        if (w <= 0) return -1;
+        buf += w; n -= w;
+    }
+    return 0;
+}
+
+static void* daemon_serve(void *arg) {
+    int cfd = (intptr_t)arg;
+    double end = clock_sec(CLOCK_MONOTONIC) + DAEMON_DEADLINE;
+    char req[4096], *args[DAEMON_MAX_ARGS];
+    size_t len = 0;
+    for (;;) {
+        ssize_t r = read(cfd, req + len, sizeof(req) - len);
+        if (r < 0 && (errno == EAGAIN || errno == EINTR)) {
+            if (daemon_wait(cfd, POLLIN, end)) break;
+            continue;
+        }
+        if (r <= 0) break;
+        if ((len += r) == sizeof(req)) break;
+    }
+    if (!len || len == sizeof(req) || req[len-1]) { close(cfd); return NULL; }
+    int n = 0;
+    for (char *p = req; p < req + len && n < DAEMON_MAX_ARGS; p += strlen(p) + 1) args[n++] = p;
+    /* the query writes its reply to memory, not to stdout and stderr */
+    char *out = NULL, *err = NULL;
+    size_t no = 0, ne = 0;
+    FILE *fo = open_memstream(&out, &no), *fe = open_memstream(&err, &ne);
+    int st = 1;
+    if (fo && fe) {
+        pthread_mutex_lock(&daemon_lock);
+        st = daemon_answer(n, args, fo, fe);
+        pthread_mutex_unlock(&daemon_lock);
+        if (st < 0) { fprintf(fe, "mpkgd: unknown query %s\n", args[0]); st = 1; }
+    }
+    if (fo) fclose(fo);
+    if (fe) fclose(fe);
+    char hdr[64];
+    int h = snprintf(hdr, sizeof(hdr), "%d %zu %zu\n", st, out ? no : 0, err ? ne : 0);
+    if (!daemon_send(cfd, hdr, h, end) && (!out || !daemon_send(cfd, out, no, end)) && err) daemon_send(cfd, err, ne, end);
+    free(out); free(err);
+    close(cfd);
+    return NULL;
+}
+
+/* something under PKG_DB_PATH was replaced: remap what it was */
+static void daemon_reload(int fd) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int db_changed = 0, repo_changed = 0, search_changed = 0, paths_changed = 0;
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->len && !strcmp(ev->name, PKGDB_FILE)) db_changed = 1;
+            if (ev->len && !strcmp(ev->name, REPOIDX_FILE)) repo_changed = 1;
+            if (ev->len && !strcmp(ev->name, SEARCHIDX_FILE)) search_changed = 1;
+            if (ev->len && (!strcmp(ev->name, PATHIDX_FILE) || !strcmp(ev->name, PATHLOG_FILE))) paths_changed = 1;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    if (db_changed && pkgdb_map() < 0) fprintf(stderr, "mpkgd: can't map %s\n", PKGDB_FILE);
+    if (repo_changed) repo_map();
+    if (paths_changed) pathidx_forget();
+    if (db_changed || repo_changed || search_changed) search_open();
+}
+
+int run_daemon(int (*query)(int argc, char *argv[], FILE *out, FILE *err)) {
+    daemon_answer = query;
+    int probe = daemon_connect();
+    if (probe >= 0) { close(probe); fprintf(stderr, "mpkgd is already running\n"); return 1; }
+    struct sockaddr_un sa;
+    if (daemon_addr(&sa)) {
+        fprintf(stderr, "%s/%s: %s\n", PKG_DB_PATH, DAEMON_SOCKET, strerror(errno));
+        return 1;
+    }
+    unlink(sa.sun_path);
+    int ls = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ls < 0 || bind(ls, (struct sockaddr *)&sa, sizeof(sa)) || listen(ls, 64)) {
+        fprintf(stderr, "Can't listen on %s: %s\n", sa.sun_path, strerror(errno));
+        return 1;
+    }
+    /* queries are read-only, so anyone may ask */
+    chmod(sa.sun_path, 0666);
+    int in = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (in < 0 || inotify_add_watch(in, PKG_DB_PATH, IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0) {
+        fprintf(stderr, "Can't watch %s: %s\n", PKG_DB_PATH, strerror(errno));
+        unlink(sa.sun_path);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction act = { .sa_handler = daemon_signal };
+    sigaction(SIGINT, &act, NULL);
+    sigaction(SIGTERM, &act, NULL);
+    repo_open();
+    search_open();
+    printf("mpkgd listening on %s\n", sa.sun_path);
+    fflush(stdout);
+    while (!daemon_stop) {
+        struct pollfd pf[2] = { { in, POLLIN, 0 }, { ls, POLLIN, 0 } };
+        if (poll(pf, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (pf[0].revents & POLLIN) {
+            pthread_mutex_lock(&daemon_lock);
+            daemon_reload(in);
+            pthread_mutex_unlock(&daemon_lock);
+        }
+        if (pf[1].revents & POLLIN) {
+            int cfd = accept4(ls, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+            if (cfd < 0) continue;
+            pthread_t t;
+            pthread_attr_t attr;
+            pthread_attr_init(&attr);
+            pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+            if (pthread_create(&t, &attr, daemon_serve, (void *)(intptr_t)cfd)) close(cfd);
+            pthread_attr_destroy(&attr);
+        }
+    }
+    unlink(sa.sun_path);
+    close(ls); close(in);
+    return 0;
+}
+
+/* libmpkg: the queries of mpkg.h. Records are copied out of the maps
+   into an arena owned by the set, so they outlive remaps and the
+   handle; each string goes through a table first so a distinct one is
+   stored once (arch, versions and depends repeat a lot). */
+#define ARENA_BLOCK 65536
+
+typedef struct Arena {
+    struct Arena *next;
+    size_t used, cap;
+    char data[];
+} Arena;
+
+struct mpkg_set {
+    const mpkg_pkg **v;
+    size_t n;
+    Arena *arena;
+    const char **slot;      /* string table, only while the set is built */
+    uint64_t *hash;
+    uint32_t nslots, used;
+};
+
+struct mpkg {
+    char err[256];
+    int mapped;         /* mpkg_open mapped packages.db, so close unmaps it */
+};
+
+static struct mpkg handle;
+static int handle_open;
+
+static void* arena_alloc(mpkg_set *s, size_t len, size_t align) {
+    Arena *a = s->arena;
+    size_t at = a ? (a->used + align - 1) & ~(align - 1) : 0;
+    if (!a || at + len > a->cap) {
+        /* small sets stay small: blocks double up to ARENA_BLOCK */
+        size_t cap = a ? (a->cap * 2 < ARENA_BLOCK ? a->cap * 2 : ARENA_BLOCK) : 4096;
+        if (cap < len) cap = len;
+        a = malloc(sizeof(Arena) + cap);
+        a->next = s->arena; a->cap = cap;
+        s->arena = a;
+        at = 0;
+    }
+    a->used = at + len;
+    return a->data + at;
+}
+
+static const char* set_str(mpkg_set *s, const char *str) {
+    if (!*str) return "";
+    if ((s->used + 1) * 2 > s->nslots) {
+        uint32_t n = s->nslots ? s->nslots * 2 : 256;
+        const char **slot = calloc(n, sizeof(char *));
+        uint64_t *hash = malloc(n * sizeof(uint64_t));
+        for (uint32_t i = 0; i < s->nslots; i++) {
+            if (!s->slot[i]) continue;
+            uint32_t j;
+            for (j = s->hash[i] & (n - 1); slot[j]; j = (j + 1) & (n - 1));
+            slot[j] = s->slot[i]; hash[j] = s->hash[i];
+        }
+        free(s->slot); free(s->hash);
+        s->slot = slot; s->hash = hash; s->nslots = n;
+    }
+    uint64_t h = path_hash(str);
+    uint32_t mask = s->nslots - 1, i;
+    for (i = h & mask; s->slot[i]; i = (i + 1) & mask)
+        if (s->hash[i] == h && !strcmp(s->slot[i], str)) return s->slot[i];
+    size_t len = strlen(str) + 1;
+    char *p = arena_alloc(s, len, 1);
+    memcpy(p, str, len);
+    s->slot[i] = p; s->hash[i] = h; s->used++;
+    return p;
+}
+
+static mpkg_set* set_new(size_t n) {
+    mpkg_set *s = calloc(1, sizeof(*s));
+    s->n = n;
+    s->v = n ? arena_alloc(s, n * sizeof(mpkg_pkg *), sizeof(void *)) : NULL;
+    return s;
+}
+
+/* done adding: drop the string table */
+static mpkg_set* set_done(mpkg_set *s) {
+    free(s->slot); free(s->hash);
+    s->slot = NULL; s->hash = NULL;
+    s->nslots = s->used = 0;
+    return s;
+}
+
+static mpkg_pkg* set_db(mpkg_set *s, const DbRecord *r) {
+    mpkg_pkg *p = arena_alloc(s, sizeof(*p), sizeof(uint64_t));
+    p->name = set_str(s, DB_STR(r->name));
+    p->version = set_str(s, DB_STR(r->version));
+    p->arch = set_str(s, DB_STR(r->arch));
+    p->description = set_str(s, DB_STR(r->description));
+    p->depends = set_str(s, DB_STR(r->depends));
+    p->size = r->size;
+    p->install_time = r->install_time;
+    p->flags = r->flags & DB_AUTO ? MPKG_AUTO : 0;
+    return p;
+}
+
+static mpkg_pkg* set_repo(mpkg_set *s, const RepoEntry *e) {
+    mpkg_pkg *p = arena_alloc(s, sizeof(*p), sizeof(uint64_t));
+    p->name = set_str(s, RS(e->name));
+    p->version = set_str(s, RS(e->version));
+    p->arch = set_str(s, RS(e->arch));
+    p->description = set_str(s, RS(e->description));
+    p->depends = set_str(s, RS(e->depends));
+    p->size = e->size;
+    p->install_time = 0;
+    p->flags = MPKG_REPO;
+    return p;
+}
+
+/* The handle is a view of the process's database, not a copy: the CLI
+   and mpkgd have mapped it already and remap it as it changes, anyone
+   else maps it here. Those processes picked their root and dbpath when
+   they mapped it, so they can't ask for others. */
+mpkg* mpkg_open(const char *root, const char *dbpath) {
+    if (handle_open) { errno = EBUSY; return NULL; }
+    if (db.map && (root || dbpath)) { errno = EINVAL; return NULL; }
+    if (root) snprintf(PKG_ROOT, sizeof(PKG_ROOT), "%s", root);
+    if (dbpath) snprintf(PKG_ROOT_DB, sizeof(PKG_ROOT_DB), "%s", dbpath);
+    errno = 0;
+    handle.mapped = !db.map;
+    if ((handle.mapped && db_paths()) || (!db.map && pkgdb_map() < 0)) {
+        if (!errno) errno = EINVAL;
+        return NULL;
+    }
+    handle_open = 1;
+    handle.err[0] = 0;
+    return &handle;
+}
+
+void mpkg_close(mpkg *m) {
+    if (!m) return;
+    if (m->mapped) pkgdb_unmap();
+    handle_open = 0;
+}
+
+const char* mpkg_error(const mpkg *m) {
+    return m ? m->err : "no handle";
+}
+
+mpkg_set* mpkg_list(mpkg *m) {
+    (void)m;
+    uint32_t n = db.hdr ? db.hdr->count : 0;
+    mpkg_set *s = set_new(n);
+    for (uint32_t i = 0; i < n; i++) s->v[i] = set_db(s, &db.rec[i]);
+    return set_done(s);
+}
+
+mpkg_set* mpkg_info(mpkg *m, const char *const *names, size_t n) {
+    (void)m;
+    mpkg_set *s = set_new(n);
+    for (size_t i = 0; i < n; i++) {
+        const DbRecord *r = pkgdb_lookup(names[i]);
+        s->v[i] = r ? set_db(s, r) : NULL;
+    }
+    return set_done(s);
+}
+
+mpkg_set* mpkg_search(mpkg *m, const char *query) {
+    (void)m;
+    size_t n;
+    int fuzzy;
+    SearchHit *hits = search_run(query, &n, &fuzzy);
+    mpkg_set *s = set_new(n);
+    for (size_t i = 0; i < n; i++) {
+        uint32_t doc = hits[i].doc;
+        mpkg_pkg *p = doc & SEARCH_REPO ? set_repo(s, &repo.ent[doc & ~SEARCH_REPO]) : set_db(s, &db.rec[doc]);
+        if (fuzzy) p->flags |= MPKG_CLOSE;
+        s->v[i] = p;
+    }
+    free(hits);
+    return set_done(s);
+}
+
+mpkg_set* mpkg_owners(mpkg *m, const char *const *paths, size_t n) {
+    if (pathidx_open()) {
+        snprintf(m->err, sizeof(m->err), "can't open %s/%s", PKG_DB_PATH, PATHIDX_FILE);
+        return NULL;
+    }
+    mpkg_set *s = set_new(n);
+    for (size_t i = 0; i < n; i++) {
+        const char *o = pathidx_owner(paths[i]);
+        const DbRecord *r = o ? pkgdb_lookup(o) : NULL;
+        s->v[i] = r ? set_db(s, r) : NULL;
+    }
+    return set_done(s);
+}
+
+mpkg_set* mpkg_required_by(mpkg *m, const char *name) {
+    (void)m;
+    const DbRecord *r = pkgdb_lookup(name);
+    uint32_t k = r ? r - db.rec : 0, from = 0, to = 0;
+    if (r && db.rdep_off) { from = db.rdep_off[k]; to = db.rdep_off[k + 1]; }
+    mpkg_set *s = set_new(to - from);
+    for (uint32_t e = from; e < to; e++) s->v[e - from] = set_db(s, &db.rec[db.rdep[e]]);
+    return set_done(s);
+}
+
+char** mpkg_files(mpkg *m, const char *name) {
+    char path[512], line[MANIFEST_LINE];
+    snprintf(path, sizeof(path), "%s/%s.files", PKG_DB_PATH, name);
+    FILE *f = fopen(path, "r");
+    if (!f) { snprintf(m->err, sizeof(m->err), "%s: %s", path, strerror(errno)); return NULL; }
+    PathList pl = {0};
+    size_t bytes = 0;
+    while (manifest_next(f, line, NULL)) {
+        if (is_dir_entry(line)) continue;
+        path_list_add(&pl, line);
+        bytes += strlen(line) + 1;
+    }
+    fclose(f);
+    char **v = malloc((pl.n + 1) * sizeof(char *) + bytes), *at = (char *)(v + pl.n + 1);
+    for (int i = 0; i < pl.n; i++) {
+        v[i] = strcpy(at, pl.v[i]);
+        at += strlen(at) + 1;
+    }
+    v[pl.n] = NULL;
+    path_list_free(&pl);
+    return v;
+}
+
+size_t mpkg_set_count(const mpkg_set *s) {
+    return s ? s->n : 0;
+}
+
+const mpkg_pkg* mpkg_set_get(const mpkg_set *s, size_t i) {
+    return s && i < s->n ? s->v[i] : NULL;
+}
+
+void mpkg_set_free(mpkg_set *s) {
+    if (!s) return;
+    for (Arena *a = s->arena, *next; a; a = next) { next = a->next; free(a); }
+    free(s);
+}
@@ -0,0 +1,79 @@
+/* mpkg.h: libmpkg, the package database behind mpkg, for tools that
+   would otherwise run the CLI and parse what it prints.
+
+   Queries return a set. Its records and strings live in one arena, with
+   each distinct string stored once, and mpkg_set_free() releases it all.
+   A set is a snapshot: it stays valid when the database changes or the
+   handle is closed. Everything here keeps its meaning and layout within
+   an MPKG_API_VERSION; new calls may be added.
+
+   A handle is not a snapshot but a view of the process's own database:
+   there is one per process, and a second mpkg_open() fails with EBUSY
+   until the first is closed. Use it from one thread at a time. In a
+   program that only uses this API, packages.db stays as mpkg_open()
+   mapped it, and the path index, repo.db and search index as the first
+   query that needed each loaded it; close and reopen to see later
+   changes. Linked into mpkg or mpkgd, the handle shares their mapping
+   and follows whatever they install or reload. Link with -lmpkg. */
+#ifndef MPKG_H
+#define MPKG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define MPKG_API_VERSION 1
+#define MPKG_API __attribute__((visibility("default")))
+
+#define MPKG_AUTO 1     /* installed only because something depended on it */
+#define MPKG_REPO 2     /* in repo.db, not installed (search results only) */
+#define MPKG_CLOSE 4    /* a close match: nothing matched every term exactly */
+
+typedef struct {
+    const char *name, *version, *arch, *description;
+    const char *depends;        /* "a, b, c" as in PKGINFO, "" if none */
+    uint64_t size;              /* installed bytes */
+    int64_t install_time;       /* 0 for repo packages */
+    uint32_t flags;             /* MPKG_AUTO, MPKG_REPO, MPKG_CLOSE */
+} mpkg_pkg;
+
+typedef struct mpkg mpkg;
+typedef struct mpkg_set mpkg_set;
+
+/* Open the database that mpkg itself would use: the config from
+   MPKG_CONFIG or /etc/mpkg.conf, then root and dbpath as --root and
+   --dbpath (NULL for neither; EINVAL in a process that has its database
+   open already). Returns NULL with errno set on failure. Closing
+   unmaps the database only if mpkg_open() mapped it. */
+MPKG_API mpkg* mpkg_open(const char *root, const char *dbpath);
+MPKG_API void mpkg_close(mpkg *m);
+/* why the last call on m failed */
+MPKG_API const char* mpkg_error(const mpkg *m);
+
+/* every installed package, by name */
+MPKG_API mpkg_set* mpkg_list(mpkg *m);
+/* one entry per name, in order; mpkg_set_get() is NULL where a name
+   isn't installed */
+MPKG_API mpkg_set* mpkg_info(mpkg *m, const char *const *names, size_t n);
+/* installed and repo packages matching every term of query, best first */
+MPKG_API mpkg_set* mpkg_search(mpkg *m, const char *query);
+/* one entry per path: the installed package that owns it, or NULL */
+MPKG_API mpkg_set* mpkg_owners(mpkg *m, const char *const *paths, size_t n);
+/* installed packages that depend on name */
+MPKG_API mpkg_set* mpkg_required_by(mpkg *m, const char *name);
+/* the files name installed, directories left out, as a NULL-terminated
+   array in one allocation: free() it. NULL if it has no manifest. */
+MPKG_API char** mpkg_files(mpkg *m, const char *name);
+
+MPKG_API size_t mpkg_set_count(const mpkg_set *s);
+MPKG_API const mpkg_pkg* mpkg_set_get(const mpkg_set *s, size_t i);
+MPKG_API void mpkg_set_free(mpkg_set *s);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
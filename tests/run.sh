@@ -0,0 +1,196 @@
+#!/bin/sh
+# run.sh: install scratch packages from a file:// repository with the mpkg
+# given as $MPKG (default ./mpkg) and check what ends up on disk and in
+# the database. Everything lives under one temporary directory.
+MPKG=$(realpath "${MPKG:-./mpkg}")
+T=$(mktemp -d)
+trap 'rm -rf "$T"' EXIT
+export MPKG_CONFIG=$T/mpkg.conf MPKG_NO_DAEMON=1
+mkdir -p "$T/repo" "$T/db" "$T/cache"
+cat > "$MPKG_CONFIG" <<EOC
+PKG_DB_PATH=$T/db
+PKG_CACHE_PATH=$T/cache
+PKG_REPO_URL=file://$T/repo
+EOC
+failed=0
+
+# pkg name depends [version [file...]]: a package with files (default:
+# one named after it) under $T/files, listed in repo.db at that version;
+# PAD=n appends n random bytes to each file
+pkg() {
+    n=$1 d=$2 v=${3:-1.0}
+    shift; shift; [ $# -gt 0 ] && shift
+    w=$T/w/$n
+    rm -rf "$w"
+    mkdir -p "$w/${T#/}/files"
+    for f in ${@:-$n}; do
+        mkdir -p "$(dirname "$w/${T#/}/files/$f")"
+        { echo "$n $v"; head -c "${PAD:-0}" /dev/urandom; } > "$w/${T#/}/files/$f"
+    done
+    printf 'name=%s\nversion=%s\narch=x86_64\ndescription=%s\ndepends=%s\n' "$n" "$v" "$n" "$d" > "$w/PKGINFO"
+    bsdtar -cJf "$T/repo/$n.tar.xz" -C "$w" PKGINFO "${T#/}"
+    [ -f "$T/repo/repo.db" ] && sed -i "/^name=$n\$/,/^\$/d" "$T/repo/repo.db"
+    printf 'name=%s\nversion=%s\ndescription=%s\ndepends=%s\ncsize=%s\nsha256=%s\n\n' "$n" "$v" "$n" "$d" \
+        $(stat -c %s "$T/repo/$n.tar.xz") $(sha256sum "$T/repo/$n.tar.xz" | cut -d' ' -f1) >> "$T/repo/repo.db"
+}
+
+# slow name: until unslow, fetching name's archive blocks on a fifo
+slow() {
+    mv "$T/repo/$1.tar.xz" "$T/$1.tar.xz"
+    mkfifo "$T/repo/$1.tar.xz"
+}
+unslow() {
+    [ -n "$2" ] && cat "$T/$1.tar.xz" > "$T/repo/$1.tar.xz"
+    rm "$T/repo/$1.tar.xz"
+    mv "$T/$1.tar.xz" "$T/repo/$1.tar.xz"
+}
+
+# wait up to 10 s for a path to appear
+await() {
+    i=0
+    while [ ! -e "$1" ] && [ $i -lt 100 ]; do sleep 0.1; i=$((i + 1)); done
+    [ -e "$1" ]
+}
+
+installed() {
+    "$MPKG" info "$1" 2>&1 | grep -q "version: "
+}
+
+check() {
+    if eval "$2"; then echo "ok   $1"; else echo "FAIL $1"; failed=1; fi
+}
+
+# a package can't write outside an image through a link it ships
+m=mpkg-test-$$
+mkdir -p "$T/w/link" "$T/w/dir/etc"
+ln -s /etc "$T/w/link/etc"
+echo x > "$T/w/dir/etc/$m"
+printf 'name=escape\nversion=1.0\narch=x86_64\ndescription=escape\ndepends=\n' > "$T/w/link/PKGINFO"
+bsdtar -cJf "$T/repo/escape.tar.xz" -C "$T/w/link" PKGINFO etc -C "$T/w/dir" "etc/$m"
+printf 'name=escape\nversion=1.0\ndescription=escape\ndepends=\n\n' >> "$T/repo/repo.db"
+mkdir "$T/img"
+"$MPKG" update > "$T/log" 2>&1
+"$MPKG" --root "$T/img" install escape >> "$T/log" 2>&1
+check "etc -> /etc then etc/x stays in the image" '[ ! -e "/etc/$m" ]'
+rm -f "/etc/$m"
+
+# rollback puts a dependency back as a dependency
+pkg dep ""
+pkg top dep
+"$MPKG" update >> "$T/log" 2>&1
+"$MPKG" install top >> "$T/log" 2>&1
+"$MPKG" remove top >> "$T/log" 2>&1
+"$MPKG" autoremove >> "$T/log" 2>&1
+"$MPKG" rollback >> "$T/log" 2>&1
+check "rollback after autoremove keeps the install reason" \
+    '"$MPKG" info dep 2>&1 | grep -q "install reason: dependency"'
+
+# a query while an install is under way leaves its files alone: slowb
+# needs slowa, so slowa is unpacked before slowb starts to download
+pkg slowa ""
+pkg slowb slowa
+slow slowb
+"$MPKG" update >> "$T/log" 2>&1
+"$MPKG" install slowb >> "$T/log" 2>&1 &
+await "$T/cache/slowb.tar.xz.part"
+"$MPKG" list >> "$T/log" 2>&1
+unslow slowb feed
+wait
+check "a query doesn't recover a running install" \
+    '[ -e "$T/files/slowa" ] && installed slowa'
+
+# an install killed before its commit record is undone by the next
+# mpkg to open the database; with the record it is finished instead
+killed() {
+    pkg "$1a" ""
+    pkg "$1b" "$1a"
+    slow "$1b"
+    "$MPKG" update >> "$T/log" 2>&1
+    "$MPKG" install "$1b" >> "$T/log" 2>&1 &
+    await "$T/cache/$1b.tar.xz.part"
+    kill -9 $!
+    wait
+    unslow "$1b"
+}
+killed kill
+"$MPKG" list >> "$T/log" 2>&1
+check "a killed install is rolled back" \
+    '[ ! -e "$T/files/killa" ] && ! installed killa'
+killed done
+echo C >> "$T/db/journal"
+"$MPKG" list >> "$T/log" 2>&1
+check "a killed install with its commit record is kept" \
+    '[ -e "$T/files/donea" ] && installed donea'
+
+# update compares versions the way user-006 expects
+newer() {
+    pkg ver "" "$1"
+    "$MPKG" update >> "$T/log" 2>&1
+    "$MPKG" update ver > "$T/out" 2>&1
+    cat "$T/out" >> "$T/log"
+    grep -q "^Updating ver" "$T/out"
+}
+pkg ver "" 1.0
+"$MPKG" update >> "$T/log" 2>&1
+"$MPKG" install ver >> "$T/log" 2>&1
+check "1.0a is newer than 1.0" 'newer 1.0a'
+check "1.10 is newer than 1.9" 'newer 1.9 && newer 1.10'
+check "1.9 is older than 1.10" '! newer 1.9'
+check "leading zeros don't count" '! newer 01.010'
+
+# a path owned by one package can't be taken by another
+pkg own1 "" 1.0 shared
+pkg own2 "" 1.0 shared
+"$MPKG" update >> "$T/log" 2>&1
+"$MPKG" install own1 >> "$T/log" 2>&1
+"$MPKG" install own2 >> "$T/log" 2>&1
+check "a second owner of a path is refused" \
+    '! installed own2 && grep -q "own1 1.0" "$T/files/shared" &&
+     "$MPKG" owns "$T/files/shared" | grep -q "owned by own1"'
+
+# an upgrade deletes what the new version no longer ships
+pkg shrink "" 1.0 shrink/x shrink/y shrink/sub/z
+"$MPKG" update >> "$T/log" 2>&1
+"$MPKG" install shrink >> "$T/log" 2>&1
+pkg shrink "" 2.0 shrink/x
+"$MPKG" update >> "$T/log" 2>&1
+"$MPKG" upgrade >> "$T/log" 2>&1
+check "upgrade removes dropped files and their directories" \
+    '[ -e "$T/files/shrink/x" ] && [ ! -e "$T/files/shrink/y" ] && [ ! -e "$T/files/shrink/sub" ]'
+
+# rolling back across a change of file set leaves the tree as it was
+pkg grow "" 1.0 grow/x
+"$MPKG" update >> "$T/log" 2>&1
+"$MPKG" install grow >> "$T/log" 2>&1
+pkg grow "" 2.0 grow/x grow/new/y
+"$MPKG" update >> "$T/log" 2>&1
+"$MPKG" upgrade >> "$T/log" 2>&1
+"$MPKG" rollback >> "$T/log" 2>&1
+check "rollback removes files the newer version added" \
+    '[ -e "$T/files/grow/x" ] && [ ! -e "$T/files/grow/new" ] && "$MPKG" info grow | grep -q "version: 1.0"'
+
+# removing the last package with files in a directory prunes it, even
+# if another package created it
+pkg mine "" 1.0 ours/sub/a
+pkg yours "" 1.0 ours/sub/b
+"$MPKG" update >> "$T/log" 2>&1
+"$MPKG" install mine yours >> "$T/log" 2>&1
+"$MPKG" remove mine >> "$T/log" 2>&1
+"$MPKG" remove yours >> "$T/log" 2>&1
+check "remove prunes directories another package created" '[ ! -e "$T/files/ours" ]'
+
+# a streamed update that fails its checksum leaves the old version alone
+pkg strm "" 1.0 strm/a strm/b
+"$MPKG" update >> "$T/log" 2>&1
+"$MPKG" install strm >> "$T/log" 2>&1
+PAD=$((4 << 20)) pkg strm "" 2.0 strm/a strm/b
+sed -i "/^name=strm\$/,/^\$/s/^sha256=.*/sha256=$(printf %064d 0)/" "$T/repo/repo.db"
+echo PKG_STREAM_INSTALL=1 >> "$MPKG_CONFIG"
+"$MPKG" update >> "$T/log" 2>&1
+"$MPKG" update strm >> "$T/log" 2>&1
+sed -i /^PKG_STREAM_INSTALL/d "$MPKG_CONFIG"
+check "a streamed update with a bad checksum keeps the old files" \
+    'grep -q "strm 1.0" "$T/files/strm/a" && grep -q "strm 1.0" "$T/files/strm/b"'
+
+[ $failed = 0 ] || cat "$T/log"
+exit $failed